@@ -1,22 +1,359 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include "LibDisk.h"
 
 typedef struct sector {
     char data[SECTOR_SIZE];
 } sector_t;
 
-// used to see what happened w/ disk ops
-int diskErrno;
+// used to see what happened w/ disk ops (each thread has its own)
+__thread int diskErrno;
+
+// a saved disk image starts with a header sector, followed by a table
+// with the CRC32C checksum of every sector, followed by the sectors
+// themselves; each of the three parts starts on a sector boundary;
+// sectors containing only zeroes are not written at all but left as
+// holes in the file, so a mostly empty disk takes little space
+#define DISK_MAGIC 0x4b534944 // "DISK"
+#define DISK_VERSION 1
+
+typedef struct header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sectorSize;
+    uint32_t totalSectors;
+    uint32_t tableSum;  // checksum of the checksum table
+    uint32_t headerSum; // checksum of the fields above
+} header_t;
+
+#define TABLE_SECTORS ((TOTAL_SECTORS * sizeof(uint32_t) + SECTOR_SIZE - 1) / SECTOR_SIZE)
+#define DATA_OFFSET ((off_t) (1 + TABLE_SECTORS) * SECTOR_SIZE)
+#define IMAGE_SIZE (DATA_OFFSET + (off_t) TOTAL_SECTORS * SECTOR_SIZE)
+
+// images written before the header existed are bare sectors; they are
+// still accepted, but there's nothing to verify them against
+#define RAW_IMAGE_SIZE ((off_t) TOTAL_SECTORS * SECTOR_SIZE)
+
+// the disk in memory is kept in pages of PAGE_SECTORS consecutive
+// sectors; a page is allocated the first time one of its sectors is
+// written (until then its sectors read as zeroes), and it may be shared
+// between the disk and any number of snapshots, in which case it is
+// copied before the disk writes to it
+#define PAGE_SECTORS 8
+#define PAGES ((TOTAL_SECTORS + PAGE_SECTORS - 1) / PAGE_SECTORS)
+
+typedef struct page {
+    int refs; // number of images sharing the page (updated atomically)
+    sector_t sectors[PAGE_SECTORS];
+} page_t;
+
+// the file an image was opened from with Disk_Open(); where the sectors
+// start in the file, and the checksums they are verified against when
+// read (only if 'checksummed' is set); never changes once opened, and
+// is shared by the disk and its snapshots
+typedef struct backstore {
+    int refs;
+    int fd;
+    off_t dataOffset;
+    int checksummed;
+    uint32_t sums[TOTAL_SECTORS];
+} backstore_t;
+
+// the content of a disk: the pages in memory and, for an opened disk,
+// the backstore together with a bitmap of the sectors that have been
+// read from it (or overwritten) already
+typedef struct image {
+    page_t *pages[PAGES];
+    backstore_t *store;
+    unsigned char resident[(TOTAL_SECTORS + 7) / 8];
+} image_t;
+
+// a snapshot is simply a frozen copy of the disk's image
+struct _disk_snapshot {
+    image_t image;
+};
 
 // the disk in memory (static makes it private to the file)
-static sector_t *disk;
+static image_t disk;
+
+// the disk image is protected by striped locks: each page belongs to
+// one of the STRIPES locks, so transfers of unrelated sectors can
+// proceed in parallel; a page covers whole bytes of the resident
+// bitmap, so the bitmap needs no lock of its own; operations on the
+// whole disk take every stripe, always in ascending order
+#define STRIPES 64
+static pthread_mutex_t stripes[STRIPES] = {
+    [0 ... STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_mutex_t *stripe_of(int sector) {
+    return &stripes[(sector / PAGE_SECTORS) % STRIPES];
+}
+
+static void lock_all() {
+    for (int i = 0; i < STRIPES; i++)
+        pthread_mutex_lock(&stripes[i]);
+}
+
+static void unlock_all() {
+    for (int i = STRIPES - 1; i >= 0; i--)
+        pthread_mutex_unlock(&stripes[i]);
+}
+
+// asynchronous requests: submitted requests wait in a FIFO queue until
+// one of the workers picks them up, finished ones wait in the FIFO of
+// the completion queue named by the request, so that independent users
+// of the disk never reap each other's requests; those that don't name
+// one use the default queue of Disk_Poll() and Disk_Wait()
+struct _disk_queue {
+    Disk_Request_t *head, *tail; // finished requests
+    pthread_cond_t done;         // signaled when one is added
+};
+
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+static Disk_Request_t *pendingHead, *pendingTail;
+static Disk_Queue_t defaultQueue = {NULL, NULL, PTHREAD_COND_INITIALIZER};
+static int workersStarted = 0;
+
+// saves go through a temporary file with a fixed name next to the
+// image, so they're made one at a time
+static pthread_mutex_t saveLock = PTHREAD_MUTEX_INITIALIZER;
+
+// used for statistics (protected by statsLock)
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static int lastSector = 0;
+static Disk_Stats_t stats;
+
+// the predefined device models, indexed by Disk_Profile_t
+static const Disk_Model_t profiles[] = {
+    // 7200 rpm: ~6ms full stroke, 4.17ms half a rotation, 100MB/s
+    {1000.0, 0.5, 4170.0, 5.12},
+    // flash: constant access latency, 500MB/s
+    {20.0, 0.0, 0.0, 1.02},
+    // no timing at all
+    {0.0, 0.0, 0.0, 0.0},
+};
+static Disk_Model_t model = {1000.0, 0.5, 4170.0, 5.12};
+
+// CRC32C (Castagnoli, reflected polynomial 0x82f63b78); computed with
+// the SSE4.2 crc32 instruction when the cpu has it, and bytewise from
+// a table otherwise
+static uint32_t crcTable[256];
+
+static void crc32c_init_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crcTable[i] = c;
+    }
+}
+
+static uint32_t crc32c_sw(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t c = 0xffffffff;
+    while (len--)
+        c = crcTable[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffff;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t c = 0xffffffff;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    uint32_t c32 = (uint32_t) c;
+    while (len--)
+        c32 = _mm_crc32_u8(c32, *p++);
+    return c32 ^ 0xffffffff;
+}
+#endif
+
+static uint32_t (*crc32c)(const void *, size_t);
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void crc32c_select() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c = crc32c_hw;
+        return;
+    }
+#endif
+    crc32c_init_table();
+    crc32c = crc32c_sw;
+}
+
+// charge an access of one sector to the statistics
+static void account(int sector, int write) {
+    pthread_mutex_lock(&statsLock);
+    if (sector != lastSector + 1) {
+        int distance = abs(sector - lastSector);
+        stats.seeks++;
+        stats.seek_distance += distance;
+        stats.time += model.seek_min + model.seek_per_sector * distance + model.rotation;
+    }
+    stats.time += model.transfer;
+    if (write) {
+        stats.writes++;
+        stats.bytes_written += SECTOR_SIZE;
+    } else {
+        stats.reads++;
+        stats.bytes_read += SECTOR_SIZE;
+    }
+    lastSector = sector;
+    pthread_mutex_unlock(&statsLock);
+}
+
+static int is_resident(image_t *img, int sector) {
+    return img->store == NULL || (img->resident[sector / 8] & (1 << (sector % 8)));
+}
 
-// used for statistics
-// static int lastSector = 0;
-// static int seekCount = 0;
+// drop one reference to a page or a backstore, freeing it with the last
+static void page_put(page_t *page) {
+    if (page && __atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(page);
+}
+
+static void store_put(backstore_t *store) {
+    if (store && __atomic_sub_fetch(&store->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(store->fd);
+        free(store);
+    }
+}
+
+// release everything an image holds and leave it empty
+static void image_clear(image_t *img) {
+    for (int i = 0; i < PAGES; i++) {
+        page_put(img->pages[i]);
+        img->pages[i] = NULL;
+    }
+    store_put(img->store);
+    img->store = NULL;
+}
+
+// return the page holding 'sector' of the disk, ready to be modified:
+// allocated if it didn't exist, and copied if a snapshot shares it;
+// must be called with the sector's stripe held
+static page_t *writable_page(int sector) {
+    page_t **slot = &disk.pages[sector / PAGE_SECTORS];
+    page_t *page = *slot;
+    if (page && __atomic_load_n(&page->refs, __ATOMIC_ACQUIRE) == 1)
+        return page;
+
+    page_t *copy = page ? malloc(sizeof(page_t)) : calloc(1, sizeof(page_t));
+    if (copy == NULL)
+        return NULL;
+    if (page) memcpy(copy->sectors, page->sectors, sizeof(copy->sectors));
+    copy->refs = 1;
+    *slot = copy;
+    page_put(page);
+    return copy;
+}
+
+// read a sector of the image's backstore into 'buf' and verify it;
+// returns 0 if successful, or -1 with the error code in 'err'
+static int store_read(backstore_t *store, int sector, sector_t *buf, int *err) {
+    ssize_t n = pread(store->fd, buf, sizeof(sector_t),
+                      store->dataOffset + (off_t) sector * sizeof(sector_t));
+    if (n != sizeof(sector_t)) {
+        *err = E_READING_FILE;
+        return -1;
+    }
+    if (store->checksummed && crc32c(buf, sizeof(sector_t)) != store->sums[sector]) {
+        *err = E_CHECKSUM;
+        return -1;
+    }
+    return 0;
+}
+
+// bring a sector of an opened disk into memory if it isn't there yet;
+// must be called with the sector's stripe held; returns 0 if
+// successful, or -1 with the error code in 'err'
+static int fault_in(int sector, int *err) {
+    if (is_resident(&disk, sector))
+        return 0;
+    sector_t buf;
+    if (store_read(disk.store, sector, &buf, err) < 0)
+        return -1;
+    page_t *page = writable_page(sector);
+    if (page == NULL) {
+        *err = E_MEM_OP;
+        return -1;
+    }
+    memcpy(&page->sectors[sector % PAGE_SECTORS], &buf, sizeof(sector_t));
+    disk.resident[sector / 8] |= 1 << (sector % 8);
+    return 0;
+}
+
+// the actual sector transfers behind both the synchronous and the
+// asynchronous interface; they report errors through 'err' instead of
+// diskErrno so that the workers can't clobber the caller's error
+static int read_sector(int sector, char *buffer, int *err) {
+    // quick error checks
+    if ((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+        *err = E_INVALID_PARAM;
+        return -1;
+    }
+
+    pthread_mutex_t *lock = stripe_of(sector);
+    pthread_mutex_lock(lock);
+    if (fault_in(sector, err) < 0) {
+        pthread_mutex_unlock(lock);
+        return -1;
+    }
+
+    // copy the memory for the user
+    page_t *page = disk.pages[sector / PAGE_SECTORS];
+    if (page)
+        memcpy((void *) buffer, (void *) &page->sectors[sector % PAGE_SECTORS], sizeof(sector_t));
+    else
+        memset(buffer, 0, sizeof(sector_t));
+    pthread_mutex_unlock(lock);
+    account(sector, 0);
+    return 0;
+}
+
+static int write_sector(int sector, char *buffer, int *err) {
+    // quick error checks
+    if ((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+        *err = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // the whole sector is overwritten, so there's no need to fault
+    // it in from the backstore first
+    pthread_mutex_t *lock = stripe_of(sector);
+    pthread_mutex_lock(lock);
+    page_t *page = writable_page(sector);
+    if (page == NULL) {
+        pthread_mutex_unlock(lock);
+        *err = E_MEM_OP;
+        return -1;
+    }
+    memcpy((void *) &page->sectors[sector % PAGE_SECTORS], (void *) buffer, sizeof(sector_t));
+    disk.resident[sector / 8] |= 1 << (sector % 8);
+    pthread_mutex_unlock(lock);
+    account(sector, 1);
+    return 0;
+}
 
 /*
  * Disk_Init
@@ -27,45 +364,336 @@ static sector_t *disk;
  *
  */
 int Disk_Init() {
-    // create the disk image and fill every sector with zeroes
-    disk = (sector_t *) calloc(TOTAL_SECTORS, sizeof(sector_t));
-    if (disk == NULL) {
+    // every sector starts out as zeroes; memory is only allocated
+    // for the pages once they are written
+    lock_all();
+    image_clear(&disk);
+    unlock_all();
+    Disk_ResetStats();
+    return 0;
+}
+
+// write 'len' bytes at the current position of 'f'
+static int put(FILE *f, const void *buf, size_t len) {
+    return fwrite(buf, 1, len, f) == len ? 0 : -1;
+}
+
+// get the content of a sector of an image for saving it: either
+// straight from memory, or read from the backstore into 'buf'; the
+// image must not change meanwhile
+static sector_t *peek_sector(image_t *img, int sector, sector_t *buf) {
+    if (!is_resident(img, sector))
+        return store_read(img->store, sector, buf, &diskErrno) < 0 ? NULL : buf;
+    page_t *page = img->pages[sector / PAGE_SECTORS];
+    if (page)
+        return &page->sectors[sector % PAGE_SECTORS];
+    memset(buf, 0, sizeof(sector_t));
+    return buf;
+}
+
+// return 1 if the sector holds nothing but zeroes
+static int is_zero(sector_t *sec) {
+    static const sector_t zero;
+    return memcmp(sec, &zero, sizeof(sector_t)) == 0;
+}
+
+// write a complete image to 'f'
+static int write_image(image_t *img, FILE *f) {
+    sector_t buf;
+    header_t *header = (header_t *) &buf;
+    size_t tableSize = TABLE_SECTORS * SECTOR_SIZE;
+    uint32_t *table = calloc(1, tableSize);
+    if (table == NULL) {
         diskErrno = E_MEM_OP;
         return -1;
     }
+
+    // the sectors go first, leaving room for the header and the table,
+    // which are only known once every sector has been seen
+    if (fseeko(f, DATA_OFFSET, SEEK_SET) < 0) {
+        free(table);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+    for (int i = 0; i < TOTAL_SECTORS; i++) {
+        sector_t *sec = peek_sector(img, i, &buf);
+        if (sec == NULL) {
+            free(table);
+            return -1;
+        }
+        table[i] = crc32c(sec, sizeof(sector_t));
+        if (is_zero(sec)) {
+            // leave a hole
+            if (fseeko(f, sizeof(sector_t), SEEK_CUR) < 0) {
+                free(table);
+                diskErrno = E_WRITING_FILE;
+                return -1;
+            }
+        } else if (put(f, sec, sizeof(sector_t)) < 0) {
+            free(table);
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+    }
+
+    // the file must extend to the end even if the last sectors are holes
+    if (fflush(f) != 0 || ftruncate(fileno(f), IMAGE_SIZE) < 0) {
+        free(table);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+
+    memset(&buf, 0, sizeof(buf));
+    header->magic = DISK_MAGIC;
+    header->version = DISK_VERSION;
+    header->sectorSize = SECTOR_SIZE;
+    header->totalSectors = TOTAL_SECTORS;
+    header->tableSum = crc32c(table, tableSize);
+    header->headerSum = crc32c(header, offsetof(header_t, headerSum));
+
+    int ret = 0;
+    if (fseeko(f, 0, SEEK_SET) < 0 || put(f, &buf, sizeof(buf)) < 0 ||
+        put(f, table, tableSize) < 0) {
+        diskErrno = E_WRITING_FILE;
+        ret = -1;
+    }
+    free(table);
+    return ret;
+}
+
+// flush the directory entry of 'file' (the rename) to stable storage
+static void sync_dir(char *file) {
+    char dir[1024] = ".";
+    char *slash = strrchr(file, '/');
+    if (slash) {
+        int len = slash == file ? 1 : (int) (slash - file);
+        if (len >= sizeof(dir)) return;
+        memcpy(dir, file, len);
+        dir[len] = '\0';
+    }
+    int fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// save an image to 'file': the image is first written to '<file>.tmp'
+// and only renamed over it once it's safely on disk, so a crash in the
+// middle leaves the old image intact (and a temporary file that the
+// next save overwrites)
+static int save_image(image_t *img, char *file) {
+    FILE *diskFile;
+    char tmp[1024 + 8];
+
+    // error check
+    if (file == NULL || strlen(file) >= 1024) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    pthread_once(&crcOnce, crc32c_select);
+    sprintf(tmp, "%s.tmp", file);
+
+    // open the diskFile
+    pthread_mutex_lock(&saveLock);
+    if ((diskFile = fopen(tmp, "w")) == NULL) {
+        pthread_mutex_unlock(&saveLock);
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+
+    // actually write the disk image to a file
+    int ret = write_image(img, diskFile);
+    if (ret == 0 && (fflush(diskFile) != 0 || fsync(fileno(diskFile)) < 0)) {
+        diskErrno = E_WRITING_FILE;
+        ret = -1;
+    }
+    if (fclose(diskFile) != 0 && ret == 0) {
+        diskErrno = E_WRITING_FILE;
+        ret = -1;
+    }
+
+    // replace the old image (an opened disk keeps reading from the old
+    // one, which stays valid until its descriptor is closed)
+    if (ret == 0 && rename(tmp, file) < 0) {
+        diskErrno = E_WRITING_FILE;
+        ret = -1;
+    }
+    if (ret < 0) unlink(tmp);
+    pthread_mutex_unlock(&saveLock);
+    if (ret < 0) return -1;
+    sync_dir(file);
     return 0;
 }
 
+/*
+ * Disk_Snapshot
+ *
+ * Takes a point-in-time copy of the disk. The snapshot shares all
+ * pages with the disk; a page is only copied when the disk writes to
+ * it afterwards, so taking a snapshot is cheap and the disk can keep
+ * going while the snapshot is saved. Returns NULL on failure.
+ */
+Disk_Snapshot_t *Disk_Snapshot() {
+    Disk_Snapshot_t *snap = malloc(sizeof(Disk_Snapshot_t));
+    if (snap == NULL) {
+        diskErrno = E_MEM_OP;
+        return NULL;
+    }
+    lock_all();
+    snap->image = disk;
+    for (int i = 0; i < PAGES; i++) {
+        if (disk.pages[i])
+            __atomic_add_fetch(&disk.pages[i]->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    if (disk.store)
+        __atomic_add_fetch(&disk.store->refs, 1, __ATOMIC_ACQ_REL);
+    unlock_all();
+    return snap;
+}
+
+/*
+ * Disk_SnapshotSave
+ *
+ * Saves a snapshot like Disk_Save() does for the disk. The disk is not
+ * locked meanwhile.
+ */
+int Disk_SnapshotSave(Disk_Snapshot_t *snap, char *file) {
+    if (snap == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    return save_image(&snap->image, file);
+}
+
+/*
+ * Disk_SnapshotRelease
+ *
+ * Frees a snapshot and whatever pages only it was still holding on to.
+ */
+void Disk_SnapshotRelease(Disk_Snapshot_t *snap) {
+    if (snap == NULL) return;
+    image_clear(&snap->image);
+    free(snap);
+}
+
 /*
  * Disk_Save
  *
  * Makes sure the current disk image gets saved to memory - this
- * will overwrite an existing file with the same name so be careful
+ * will overwrite an existing file with the same name so be careful.
+ * The image is first written to a temporary file next to 'file' and
+ * only renamed over it once it's safely on disk, so a crash in the
+ * middle leaves the old image intact. Writing happens from a snapshot,
+ * so other threads can keep using the disk while it's being saved.
  */
 int Disk_Save(char *file) {
-    FILE *diskFile;
+    Disk_Snapshot_t *snap = Disk_Snapshot();
+    if (snap == NULL) return -1;
+    int ret = Disk_SnapshotSave(snap, file);
+    Disk_SnapshotRelease(snap);
+    return ret;
+}
+
+// open an image file, check its header and load its checksum table;
+// returns the new backstore, or NULL with diskErrno set
+static backstore_t *open_image(char *file) {
+    struct stat st;
+    int fd;
 
     // error check
     if (file == NULL) {
         diskErrno = E_INVALID_PARAM;
-        return -1;
+        return NULL;
     }
+    pthread_once(&crcOnce, crc32c_select);
 
     // open the diskFile
-    if ((diskFile = fopen(file, "w")) == NULL) {
+    if ((fd = open(file, O_RDONLY)) < 0) {
         diskErrno = E_OPENING_FILE;
-        return -1;
+        return NULL;
+    }
+    backstore_t *store = calloc(1, sizeof(backstore_t));
+    if (store == NULL) {
+        close(fd);
+        diskErrno = E_MEM_OP;
+        return NULL;
+    }
+    store->refs = 1;
+    store->fd = fd;
+    if (fstat(fd, &st) < 0) {
+        store_put(store);
+        diskErrno = E_READING_FILE;
+        return NULL;
     }
 
-    // actually write the disk image to a file
-    if ((fwrite(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
-        fclose(diskFile);
-        diskErrno = E_WRITING_FILE;
-        return -1;
+    if (st.st_size == RAW_IMAGE_SIZE) {
+        // old image without header
+        return store;
     }
 
-    // clean up and return
-    fclose(diskFile);
+    // the header must describe exactly this disk
+    sector_t buf;
+    header_t *header = (header_t *) &buf;
+    if (st.st_size != IMAGE_SIZE || pread(fd, &buf, sizeof(buf), 0) != sizeof(buf)) {
+        store_put(store);
+        diskErrno = E_READING_FILE;
+        return NULL;
+    }
+    if (header->magic != DISK_MAGIC || header->version != DISK_VERSION ||
+        header->sectorSize != SECTOR_SIZE || header->totalSectors != TOTAL_SECTORS ||
+        header->headerSum != crc32c(header, offsetof(header_t, headerSum))) {
+        store_put(store);
+        diskErrno = E_CHECKSUM;
+        return NULL;
+    }
+
+    size_t tableSize = TABLE_SECTORS * SECTOR_SIZE;
+    uint32_t *table = malloc(tableSize);
+    if (table == NULL) {
+        store_put(store);
+        diskErrno = E_MEM_OP;
+        return NULL;
+    }
+    if (pread(fd, table, tableSize, SECTOR_SIZE) != tableSize) {
+        free(table);
+        store_put(store);
+        diskErrno = E_READING_FILE;
+        return NULL;
+    }
+    if (crc32c(table, tableSize) != header->tableSum) {
+        free(table);
+        store_put(store);
+        diskErrno = E_CHECKSUM;
+        return NULL;
+    }
+    memcpy(store->sums, table, sizeof(store->sums));
+    free(table);
+    store->dataOffset = DATA_OFFSET;
+    store->checksummed = 1;
+    return store;
+}
+
+// read sectors [start, stop) from the backstore into freshly allocated
+// pages of 'img'; returns 0 if successful, -1 otherwise
+static int load_range(image_t *img, backstore_t *store, int start, int stop) {
+    while (start < stop) {
+        int p = start / PAGE_SECTORS;
+        int end = (p + 1) * PAGE_SECTORS;
+        if (end > stop) end = stop;
+        if (img->pages[p] == NULL && (img->pages[p] = calloc(1, sizeof(page_t))) == NULL) {
+            diskErrno = E_MEM_OP;
+            return -1;
+        }
+        img->pages[p]->refs = 1;
+        size_t len = (end - start) * sizeof(sector_t);
+        if (pread(store->fd, &img->pages[p]->sectors[start % PAGE_SECTORS], len,
+                  store->dataOffset + (off_t) start * sizeof(sector_t)) != len) {
+            diskErrno = E_READING_FILE;
+            return -1;
+        }
+        start = end;
+    }
     return 0;
 }
 
@@ -73,32 +701,99 @@ int Disk_Save(char *file) {
  * Disk_Load
  *
  * Loads a current disk image from disk into memory - requires that
- * the disk be created first.
+ * the disk be created first. Every sector is checked against its
+ * checksum.
  */
 int Disk_Load(char *file) {
-    FILE *diskFile;
+    backstore_t *store = open_image(file);
+    if (store == NULL) return -1;
 
-    // error check
-    if (file == NULL) {
-        diskErrno = E_INVALID_PARAM;
+    // actually read the disk image into memory; only the parts of the
+    // file that hold data are read, the holes are all zeroes and don't
+    // need any pages
+    image_t *img = calloc(1, sizeof(image_t));
+    if (img == NULL) {
+        store_put(store);
+        diskErrno = E_MEM_OP;
         return -1;
     }
+    int fd = store->fd;
+    off_t offset = store->dataOffset;
+    off_t end = offset + (off_t) TOTAL_SECTORS * sizeof(sector_t);
+    off_t pos = offset;
+    int ret = 0;
+    while (ret == 0 && pos < end) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        off_t hole = data < 0 ? -1 : lseek(fd, data, SEEK_HOLE);
+        if (data < 0 && errno == ENXIO) {
+            // no data after 'pos'
+            break;
+        } else if (data < 0 || hole < 0) {
+            // the file system can't tell; read everything
+            data = pos;
+            hole = end;
+        }
+        if (data > end) data = end;
+        if (hole > end) hole = end;
 
-    // open the diskFile
-    if ((diskFile = fopen(file, "r")) == NULL) {
-        diskErrno = E_OPENING_FILE;
-        return -1;
+        // holes and data are aligned to file system blocks, which may
+        // not line up with our sectors
+        int start = (data - offset) / sizeof(sector_t);
+        int stop = (hole - offset + sizeof(sector_t) - 1) / sizeof(sector_t);
+        ret = load_range(img, store, start, stop);
+        pos = offset + (off_t) stop * sizeof(sector_t);
     }
 
-    // actually read the disk image into memory
-    if ((fread(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
-        fclose(diskFile);
-        diskErrno = E_READING_FILE;
+    // verify everything
+    for (int i = 0; ret == 0 && store->checksummed && i < TOTAL_SECTORS; i++) {
+        sector_t buf;
+        if (crc32c(peek_sector(img, i, &buf), sizeof(sector_t)) != store->sums[i]) {
+            diskErrno = E_CHECKSUM;
+            ret = -1;
+        }
+    }
+    store_put(store);
+    if (ret < 0) {
+        image_clear(img);
+        free(img);
         return -1;
     }
 
     // clean up and return
-    fclose(diskFile);
+    lock_all();
+    image_clear(&disk);
+    disk = *img;
+    unlock_all();
+    free(img);
+    return 0;
+}
+
+/*
+ * Disk_Open
+ *
+ * Like Disk_Load(), but instead of reading the whole image up front the
+ * file is kept open and each sector is read (and checked) from it the
+ * first time it is accessed. The file itself is never written; use
+ * Disk_Save() to store the disk. A temporary file left next to it by a
+ * save that didn't complete is removed.
+ */
+int Disk_Open(char *file) {
+    backstore_t *store = open_image(file);
+    if (store == NULL) return -1;
+
+    char tmp[1024 + 8];
+    if (strlen(file) < 1024) {
+        sprintf(tmp, "%s.tmp", file);
+        pthread_mutex_lock(&saveLock);
+        unlink(tmp);
+        pthread_mutex_unlock(&saveLock);
+    }
+
+    lock_all();
+    image_clear(&disk);
+    memset(disk.resident, 0, sizeof(disk.resident));
+    disk.store = store;
+    unlock_all();
     return 0;
 }
 
@@ -109,37 +804,269 @@ int Disk_Load(char *file) {
  * by the user.
  */
 int Disk_Read(int sector, char *buffer) {
-    // quick error checks
-    if ((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+    return read_sector(sector, buffer, &diskErrno);
+}
+
+/*
+ * Disk_Write
+ *
+ * Writes a single sector from memory to "disk".
+ */
+int Disk_Write(int sector, char *buffer) {
+    return write_sector(sector, buffer, &diskErrno);
+}
+
+/*
+ * Disk_SetProfile
+ *
+ * Selects one of the predefined device models for the simulated time.
+ */
+int Disk_SetProfile(Disk_Profile_t profile) {
+    if (profile < DISK_PROFILE_HDD || profile > DISK_PROFILE_NONE) {
         diskErrno = E_INVALID_PARAM;
         return -1;
     }
+    return Disk_SetModel((Disk_Model_t *) &profiles[profile]);
+}
 
-    // copy the memory for the user
-    if ((memcpy((void *) buffer, (void *) (disk + sector), sizeof(sector_t))) == NULL) {
-        diskErrno = E_MEM_OP;
+/*
+ * Disk_SetModel
+ *
+ * Sets a custom device model; none of the times may be negative.
+ */
+int Disk_SetModel(Disk_Model_t *m) {
+    if (m == NULL || m->seek_min < 0 || m->seek_per_sector < 0 ||
+        m->rotation < 0 || m->transfer < 0) {
+        diskErrno = E_INVALID_PARAM;
         return -1;
     }
+    pthread_mutex_lock(&statsLock);
+    model = *m;
+    pthread_mutex_unlock(&statsLock);
+    return 0;
+}
 
+/*
+ * Disk_GetStats
+ *
+ * Copies the statistics collected so far into 'st'.
+ */
+int Disk_GetStats(Disk_Stats_t *st) {
+    if (st == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    pthread_mutex_lock(&statsLock);
+    *st = stats;
+    pthread_mutex_unlock(&statsLock);
     return 0;
 }
 
 /*
- * Disk_Write
+ * Disk_ResetStats
  *
- * Writes a single sector from memory to "disk".
+ * Clears all counters and the simulated time, and parks the head at
+ * sector zero.
  */
-int Disk_Write(int sector, char *buffer) {
+void Disk_ResetStats() {
+    pthread_mutex_lock(&statsLock);
+    memset(&stats, 0, sizeof(stats));
+    lastSector = 0;
+    pthread_mutex_unlock(&statsLock);
+}
+
+// body of the worker threads: take requests off the pending queue,
+// perform them and move them to the done queue
+static void *disk_worker(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&queueLock);
+        while (pendingHead == NULL)
+            pthread_cond_wait(&queueReady, &queueLock);
+        Disk_Request_t *req = pendingHead;
+        pendingHead = req->next;
+        if (pendingHead == NULL) pendingTail = NULL;
+        pthread_mutex_unlock(&queueLock);
+
+        req->error = 0;
+        if (req->op == DISK_OP_READ)
+            req->result = read_sector(req->sector, req->buffer, &req->error);
+        else if (req->op == DISK_OP_WRITE)
+            req->result = write_sector(req->sector, req->buffer, &req->error);
+        else if (req->op == DISK_OP_SAVE) {
+            req->result = Disk_SnapshotSave(req->snapshot, req->buffer);
+            if (req->result < 0) req->error = diskErrno;
+        } else {
+            req->result = -1;
+            req->error = E_INVALID_PARAM;
+        }
+
+        Disk_Queue_t *q = req->queue ? req->queue : &defaultQueue;
+        pthread_mutex_lock(&queueLock);
+        req->next = NULL;
+        if (q->tail) q->tail->next = req;
+        else q->head = req;
+        q->tail = req;
+        pthread_cond_broadcast(&q->done);
+        pthread_mutex_unlock(&queueLock);
+    }
+    return NULL;
+}
+
+// start the worker threads the first time a request is submitted;
+// must be called with queueLock held
+static int start_workers() {
+    if (workersStarted) return 0;
+    for (int i = 0; i < DISK_WORKERS; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, disk_worker, NULL) != 0) {
+            // the ones already running can still serve the queue
+            if (i > 0) break;
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    workersStarted = 1;
+    return 0;
+}
+
+// move up to 'max' finished requests of a queue to 'done'; must be
+// called with queueLock held
+static int reap(Disk_Queue_t *q, Disk_Request_t **done, int max) {
+    int n = 0;
+    while (n < max && q->head) {
+        done[n++] = q->head;
+        q->head = q->head->next;
+        if (q->head == NULL) q->tail = NULL;
+    }
+    return n;
+}
+
+/*
+ * Disk_Submit
+ *
+ * Queues 'n' sector requests to be carried out in the background and
+ * returns right away. Requests may complete in any order; each one is
+ * handed back through its completion queue once it's done, with its
+ * result and error fields filled in: by Disk_QueuePoll() or
+ * Disk_QueueWait() on the queue the request names, or by Disk_Poll()
+ * or Disk_Wait() if it names none.
+ */
+int Disk_Submit(Disk_Request_t **reqs, int n) {
     // quick error checks
-    if ((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+    if (reqs == NULL || n < 0) {
         diskErrno = E_INVALID_PARAM;
         return -1;
     }
+    for (int i = 0; i < n; i++) {
+        if (reqs[i] == NULL) {
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+    }
 
-    // copy the memory for the user
-    if ((memcpy((void *) (disk + sector), (void *) buffer, sizeof(sector_t))) == NULL) {
+    pthread_mutex_lock(&queueLock);
+    if (start_workers() < 0) {
+        pthread_mutex_unlock(&queueLock);
         diskErrno = E_MEM_OP;
         return -1;
     }
-    return 0;
+    for (int i = 0; i < n; i++) {
+        reqs[i]->next = NULL;
+        if (pendingTail) pendingTail->next = reqs[i];
+        else pendingHead = reqs[i];
+        pendingTail = reqs[i];
+    }
+    pthread_cond_broadcast(&queueReady);
+    pthread_mutex_unlock(&queueLock);
+    return n;
+}
+
+/*
+ * Disk_QueueCreate
+ *
+ * Creates a completion queue of its own for a user of the disk: the
+ * requests naming it are only handed back by Disk_QueuePoll() and
+ * Disk_QueueWait() on it. Returns NULL on failure.
+ */
+Disk_Queue_t *Disk_QueueCreate() {
+    Disk_Queue_t *q = malloc(sizeof(Disk_Queue_t));
+    if (q == NULL || pthread_cond_init(&q->done, NULL) != 0) {
+        free(q);
+        diskErrno = E_MEM_OP;
+        return NULL;
+    }
+    q->head = q->tail = NULL;
+    return q;
+}
+
+/*
+ * Disk_QueueDestroy
+ *
+ * Frees a completion queue; none of the requests naming it may still
+ * be outstanding.
+ */
+void Disk_QueueDestroy(Disk_Queue_t *queue) {
+    if (queue == NULL) return;
+    pthread_cond_destroy(&queue->done);
+    free(queue);
+}
+
+/*
+ * Disk_QueuePoll
+ *
+ * Hands back up to 'max' completed requests of a queue without waiting;
+ * returns how many were stored in 'done' (possibly zero).
+ */
+int Disk_QueuePoll(Disk_Queue_t *queue, Disk_Request_t **done, int max) {
+    if (queue == NULL || done == NULL || max < 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    pthread_mutex_lock(&queueLock);
+    int n = reap(queue, done, max);
+    pthread_mutex_unlock(&queueLock);
+    return n;
+}
+
+/*
+ * Disk_QueueWait
+ *
+ * Like Disk_QueuePoll(), but blocks until at least 'min' requests of
+ * the queue have completed. The caller must make sure that many are
+ * outstanding.
+ */
+int Disk_QueueWait(Disk_Queue_t *queue, Disk_Request_t **done, int min, int max) {
+    if (queue == NULL || done == NULL || min < 0 || max < min) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    pthread_mutex_lock(&queueLock);
+    int n = reap(queue, done, max);
+    while (n < min) {
+        pthread_cond_wait(&queue->done, &queueLock);
+        n += reap(queue, done + n, max - n);
+    }
+    pthread_mutex_unlock(&queueLock);
+    return n;
+}
+
+/*
+ * Disk_Poll
+ *
+ * Hands back up to 'max' completed requests that don't name a queue,
+ * without waiting; returns how many were stored in 'done' (possibly
+ * zero).
+ */
+int Disk_Poll(Disk_Request_t **done, int max) {
+    return Disk_QueuePoll(&defaultQueue, done, max);
+}
+
+/*
+ * Disk_Wait
+ *
+ * Like Disk_Poll(), but blocks until at least 'min' requests have
+ * completed. The caller must make sure that many are outstanding.
+ */
+int Disk_Wait(Disk_Request_t **done, int min, int max) {
+    return Disk_QueueWait(&defaultQueue, done, min, max);
 }
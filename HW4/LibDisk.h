@@ -1,14 +1,17 @@
 //
 // Disk.h
 //
-// Emulates a very simple disk (no timing issues). Allows user to
-// read and write to the disk just as if it was dealing with sectors
+// Emulates a very simple disk. Allows user to read and write to the
+// disk just as if it was dealing with sectors; the time the accesses
+// would take on a real device is simulated and kept with the other
+// statistics
 //
 //
 
-/***************************/
-/* DO NOT MODIFY THIS FILE */
-/***************************/
+/***********************************************/
+/* shared by the file system and its programs: */
+/* keep the calls below backward compatible    */
+/***********************************************/
     
 #ifndef __Disk_H__
 #define __Disk_H__
@@ -17,6 +20,9 @@
 #define SECTOR_SIZE 512
 #define TOTAL_SECTORS 10000 
 
+// number of worker threads serving asynchronous requests
+#define DISK_WORKERS 4
+
 // disk errors
 typedef enum {
   E_MEM_OP,
@@ -24,14 +30,95 @@ typedef enum {
   E_OPENING_FILE,
   E_WRITING_FILE,
   E_READING_FILE,
+  E_CHECKSUM,      // the image is damaged
 } Disk_Error_t;
 
-extern int diskErrno; // used to see what happened w/ disk ops
+extern __thread int diskErrno; // used to see what happened w/ disk ops (per thread)
+
+// a point-in-time copy of the disk (see Disk_Snapshot())
+typedef struct _disk_snapshot Disk_Snapshot_t;
+
+// where completed asynchronous requests are handed back (see
+// Disk_QueueCreate())
+typedef struct _disk_queue Disk_Queue_t;
+
+// asynchronous operations
+typedef enum {
+  DISK_OP_READ,
+  DISK_OP_WRITE,
+  DISK_OP_SAVE,  // save 'snapshot' to the file named by 'buffer'
+} Disk_Op_t;
+
+// a single asynchronous request; the caller owns the memory and must
+// not touch it between Disk_Submit() and its completion; a read or
+// write transfers one sector, a save writes a whole snapshot to a file
+// as Disk_SnapshotSave() does (and 'sector' is unused)
+typedef struct _disk_request {
+  Disk_Op_t op;   // read, write or save
+  int sector;     // sector to transfer (reads and writes only)
+  char *buffer;   // SECTOR_SIZE bytes to read into or write from, or for
+                  // DISK_OP_SAVE, the name of the file (which must stay
+                  // valid until the request completes)
+  Disk_Snapshot_t *snapshot; // the snapshot to save (DISK_OP_SAVE only;
+                             // the caller releases it after completion)
+  void *data;     // opaque pointer for the caller, whatever the op;
+                  // untouched by the disk
+  int result;     // 0 on success, -1 on failure (set on completion)
+  int error;      // diskErrno value of a failed request
+  Disk_Queue_t *queue; // where it's handed back on completion; NULL
+                       // for the default queue of Disk_Poll()/Disk_Wait()
+  struct _disk_request *next; // used internally for queueing
+} Disk_Request_t;
+
+// timing model of the emulated device; all times are in microseconds
+typedef struct {
+  double seek_min;        // settle time of any non-sequential access
+  double seek_per_sector; // additional seek time per sector of distance
+  double rotation;        // average rotational latency after a seek
+  double transfer;        // time to transfer one sector
+} Disk_Model_t;
+
+// predefined device models
+typedef enum {
+  DISK_PROFILE_HDD,  // 7200 rpm hard disk (the default)
+  DISK_PROFILE_SSD,  // flash drive: no seek distance, no rotation
+  DISK_PROFILE_NONE, // all accesses are free
+} Disk_Profile_t;
+
+// i/o statistics collected since Disk_Init() or Disk_ResetStats()
+typedef struct {
+  long reads;         // sectors read
+  long writes;        // sectors written
+  long bytes_read;
+  long bytes_written;
+  long seeks;         // accesses not following the previous sector
+  long seek_distance; // total number of sectors traveled by seeks
+  double time;        // simulated device time in microseconds
+} Disk_Stats_t;
 
 int Disk_Init();
 int Disk_Save(char* file);
 int Disk_Load(char* file);
+int Disk_Open(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
 
+Disk_Snapshot_t* Disk_Snapshot();
+int Disk_SnapshotSave(Disk_Snapshot_t* snap, char* file);
+void Disk_SnapshotRelease(Disk_Snapshot_t* snap);
+
+int Disk_SetProfile(Disk_Profile_t profile);
+int Disk_SetModel(Disk_Model_t* model);
+int Disk_GetStats(Disk_Stats_t* stats);
+void Disk_ResetStats();
+
+int Disk_Submit(Disk_Request_t** reqs, int n);
+int Disk_Poll(Disk_Request_t** done, int max);
+int Disk_Wait(Disk_Request_t** done, int min, int max);
+
+Disk_Queue_t* Disk_QueueCreate();
+void Disk_QueueDestroy(Disk_Queue_t* queue);
+int Disk_QueuePoll(Disk_Queue_t* queue, Disk_Request_t** done, int max);
+int Disk_QueueWait(Disk_Queue_t* queue, Disk_Request_t** done, int min, int max);
+
 #endif // __Disk_H__
@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +30,14 @@ void noprintf(char *str, ...) {}
 // the magic number chosen for our file system
 #define OS_MAGIC 0xdeadbeef
 
+// the layout version, kept in the superblock right after the magic
+// number; it changes whenever the on-disk structures do
+#define OS_VERSION 4
+
+// the third integer of the superblock is the sequence number of the
+// last journal commit the disk image includes (see the journal below)
+#define SUPERBLOCK_SEQ 2
+
 // 2. the inode bitmap (one or more sectors), which indicates whether
 // the particular entry in the inode table (#4) is currently in use
 #define INODE_BITMAP_START_SECTOR 1
@@ -52,13 +63,46 @@ void noprintf(char *str, ...) {}
 #define INODE_TABLE_START_SECTOR (SECTOR_BITMAP_START_SECTOR+SECTOR_BITMAP_SECTORS)
 
 
+// the data blocks of a file are described by extents, each a run of
+// consecutive disk sectors; a file written sequentially is then just a
+// few extents instead of one index per sector
+typedef struct _extent {
+    int start; // first disk sector of the run
+    int len;   // number of sectors in the run
+} extent_t;
+
+// the first extents of a file are kept in the inode itself; the next
+// ones go to an indirect block, a sector full of extents, and after
+// that to the indirect blocks listed in the double-indirect block
+#define DIRECT_EXTENTS 13
+#define EXTENTS_PER_SECTOR (SECTOR_SIZE/sizeof(extent_t))
+#define POINTERS_PER_SECTOR (SECTOR_SIZE/sizeof(int))
+#define MAX_EXTENTS (DIRECT_EXTENTS+EXTENTS_PER_SECTOR+POINTERS_PER_SECTOR*EXTENTS_PER_SECTOR)
+
+// the content of a small file or directory (up to INLINE_SIZE bytes,
+// a few directory entries) is kept in the inode itself, in place of
+// the extents, and takes no data blocks
+#define INLINE_SIZE (DIRECT_EXTENTS*sizeof(extent_t)+2*sizeof(int))
+
+// flags of an inode
+#define INODE_INLINE 1 // the content is kept inline
+
 // an inode is used to represent each file or directory; the data
 // structure supposedly contains all necessary information about the
 // corresponding file or directory
 typedef struct _inode {
     int size; // the size of the file or number of directory entries
     int type; // 0 means regular file; 1 means directory
-    int data[MAX_SECTORS_PER_FILE]; // indices to sectors containing data blocks
+    int flags; // see above
+    int nextents; // number of extents in use (0 if the content is inline)
+    union {
+        struct {
+            extent_t ext[DIRECT_EXTENTS]; // the first data blocks, in file order
+            int indirect;  // sector of the indirect block (0 if none)
+            int dindirect; // sector of the double-indirect block (0 if none)
+        };
+        char data[INLINE_SIZE]; // the content, if inline
+    };
 } inode_t;
 
 // the inode structures are stored consecutively and yet they don't
@@ -83,8 +127,11 @@ typedef struct _inode {
 // max length of a filename is 16 bytes (including the ending null)
 #define MAX_NAME 16
 
-// max number of open files is 256
-#define MAX_OPEN_FILES 256
+// max number of open files at once, 65536 unless defined otherwise
+// when compiling (the table of open files only grows as needed)
+#ifndef MAX_OPEN_FILES
+#define MAX_OPEN_FILES 65536
+#endif
 
 // each directory entry represents a file/directory in the parent
 // directory, and consists of a file/directory name (less than 16
@@ -97,109 +144,1396 @@ typedef struct _dirent {
 // the number of directory entries that can be contained in a sector
 #define DIRENTS_PER_SECTOR (SECTOR_SIZE/sizeof(dirent_t))
 
-// global errno value here
-int osErrno;
+// errno value here, one per thread
+__thread int osErrno;
 
 // the name of the disk backstore file (with which the file system is booted)
 static char bs_filename[1024];
 
 /* the following functions are internal helper functions */
-inode_t *loadInode(int inode_index);
+
+// the file system may be used by several threads at once: operations
+// that change the name space (creating and removing files and
+// directories) hold 'ns_lock' exclusively, while path lookups hold it
+// shared; each in-core inode has a reader/writer lock protecting its
+// content; the inode cache, the open file table, the bitmaps, the
+// buffer cache and the dentry cache have a mutex each; locks are taken
+// in this order: 'ns_lock', inode locks (a directory before its
+// entries), the inode cache, the open file table, the bitmaps, the
+// buffer cache, the dentry cache; the journal has a mutex of its own,
+// which is never held while taking another one
+static pthread_rwlock_t ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// the buffer cache keeps the most recently used disk sectors in memory
+// so that repeated accesses to the same sector (the bitmaps, the inode
+// table, directories) don't have to go to the disk; it is write-back:
+// a modified sector is only written to the disk when it's evicted or
+// when FS_Sync() is called; replacement follows the CLOCK algorithm;
+// sectors can also be read ahead into the cache in the background, in
+// which case their slot is pending until the disk has delivered them;
+// the functions taking 'cache_lock' are cache_reset(), cache_read(),
+// cache_copy(), cache_write(), cache_patch(), cache_flush(),
+// cache_readahead() and cache_read_direct(), the others expect the
+// caller to hold it
+#define CACHE_SECTORS 256
+#define CACHE_BUCKETS 512
+
+typedef struct _buf {
+    int sector;  // the disk sector held (-1 if the slot is free)
+    int dirty;   // 1 if modified since read from disk
+    int used;    // reference bit for CLOCK
+    int next;    // next slot in the same hash bucket (-1 ends the chain)
+    int pending; // 1 while the sector is being read ahead
+    Disk_Request_t req; // the read-ahead request
+    char data[SECTOR_SIZE];
+} buf_t;
+
+static buf_t cache[CACHE_SECTORS];
+static int cache_buckets[CACHE_BUCKETS]; // first slot of each hash chain
+static int cache_hand; // CLOCK hand
+static int cache_hits, cache_misses;
+static int cache_inflight; // asynchronous requests not yet collected
+static int cache_reaping;  // 1 while a thread waits for completions
+static Disk_Queue_t *cache_queue; // where the disk hands them back
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_reaped = PTHREAD_COND_INITIALIZER;
+
+// one bit per disk sector modified since the last journal commit
+static uint64_t cache_changed[(TOTAL_SECTORS + 63) / 64];
+#define CACHE_CHANGE(sector) (cache_changed[(sector) / 64] |= 1ULL << ((sector) % 64))
+
+// return the slot holding the given sector, or -1 if it's not cached
+static int cache_lookup(int sector) {
+    for (int i = cache_buckets[sector % CACHE_BUCKETS]; i >= 0; i = cache[i].next) {
+        if (cache[i].sector == sector)
+            return i;
+    }
+    return -1;
+}
+
+// unlink a slot from its hash chain
+static void cache_unhash(int slot) {
+    int *link = &cache_buckets[cache[slot].sector % CACHE_BUCKETS];
+    while (*link != slot)
+        link = &cache[*link].next;
+    *link = cache[slot].next;
+    cache[slot].next = -1;
+}
+
+// account for 'n' completed asynchronous requests, all made through
+// the cache (they come from its own queue); a read-ahead (whose 'data'
+// is NULL) leaves its slot holding the sector, or frees it if the read
+// failed; any other request is a direct transfer, and its 'data'
+// points to the number of them the issuer still waits for
+static void cache_complete(Disk_Request_t **done, int n) {
+    for (int i = 0; i < n; i++) {
+        cache_inflight--;
+        if (done[i]->data) {
+            (*(int *) done[i]->data)--;
+            continue;
+        }
+        buf_t *b = (buf_t *) ((char *) done[i] - offsetof(buf_t, req));
+        b->pending = 0;
+        if (done[i]->result < 0) {
+            cache_unhash((int) (b - cache));
+            b->sector = -1;
+        }
+    }
+}
+
+// wait for some asynchronous request to complete (there must be one
+// in flight); only one thread at a time waits for the disk, without
+// holding 'cache_lock', the others wait for it to collect the requests
+static void cache_progress() {
+    if (cache_reaping) {
+        pthread_cond_wait(&cache_reaped, &cache_lock);
+        return;
+    }
+    cache_reaping = 1;
+    pthread_mutex_unlock(&cache_lock);
+    Disk_Request_t *done[CACHE_SECTORS];
+    int n = Disk_QueueWait(cache_queue, done, 1, CACHE_SECTORS);
+    pthread_mutex_lock(&cache_lock);
+    if (n > 0) cache_complete(done, n);
+    cache_reaping = 0;
+    pthread_cond_broadcast(&cache_reaped);
+}
+
+// drop everything from the cache without writing it back (used when
+// the disk is reloaded)
+static void cache_reset() {
+    pthread_mutex_lock(&cache_lock);
+    while (cache_inflight > 0)
+        cache_progress();
+    for (int i = 0; i < CACHE_SECTORS; i++) {
+        cache[i].sector = -1;
+        cache[i].dirty = 0;
+        cache[i].used = 0;
+        cache[i].next = -1;
+        cache[i].pending = 0;
+    }
+    for (int i = 0; i < CACHE_BUCKETS; i++)
+        cache_buckets[i] = -1;
+    cache_hand = 0;
+    cache_hits = cache_misses = 0;
+    memset(cache_changed, 0, sizeof(cache_changed));
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// find a slot for a new sector, writing back the victim if it's dirty;
+// returns the slot, or -1 if the victim couldn't be written
+static int cache_evict() {
+    for (;;) {
+        buf_t *b = &cache[cache_hand];
+        int slot = cache_hand;
+        cache_hand = (cache_hand + 1) % CACHE_SECTORS;
+        if (b->pending) continue; // busy
+        if (b->sector >= 0 && b->used) {
+            // give it a second chance
+            b->used = 0;
+            continue;
+        }
+        if (b->sector >= 0) {
+            if (b->dirty && Disk_Write(b->sector, b->data) < 0)
+                return -1;
+            dprintf("... cache: evict sector %d\n", b->sector);
+            cache_unhash(slot);
+            b->sector = -1;
+            b->dirty = 0;
+        }
+        return slot;
+    }
+}
+
+// put a slot on the hash chain of its (new) sector
+static void cache_insert(int slot, int sector) {
+    cache[slot].sector = sector;
+    cache[slot].used = 1;
+    cache[slot].next = cache_buckets[sector % CACHE_BUCKETS];
+    cache_buckets[sector % CACHE_BUCKETS] = slot;
+}
+
+// return the slot holding the given sector once it's no longer
+// pending, or -1 if it's not cached
+static int cache_find(int sector) {
+    int slot = cache_lookup(sector);
+    if (slot >= 0 && cache[slot].pending) {
+        while (cache[slot].pending)
+            cache_progress();
+        if (cache[slot].sector != sector) return -1; // the read failed
+    }
+    return slot;
+}
+
+// return the cached content of a sector, reading it from the disk if
+// it isn't cached; return NULL on error
+static char *cache_get(int sector) {
+    if (sector < 0 || sector >= TOTAL_SECTORS) {
+        diskErrno = E_INVALID_PARAM;
+        return NULL;
+    }
+    int slot = cache_find(sector);
+    if (slot >= 0) {
+        cache_hits++;
+    } else {
+        cache_misses++;
+        if ((slot = cache_evict()) < 0)
+            return NULL;
+        if (Disk_Read(sector, cache[slot].data) < 0)
+            return NULL;
+        cache_insert(slot, sector);
+    }
+    cache[slot].used = 1;
+    return cache[slot].data;
+}
+
+// copy 'n' bytes from 'offset' on of a sector through the cache;
+// return 0 if successful, -1 otherwise
+static int cache_copy(int sector, int offset, char *buffer, int n) {
+    pthread_mutex_lock(&cache_lock);
+    char *data = cache_get(sector);
+    if (data) memcpy(buffer, data + offset, (size_t) n);
+    pthread_mutex_unlock(&cache_lock);
+    return data ? 0 : -1;
+}
+
+// read a sector through the cache; same interface as Disk_Read()
+static int cache_read(int sector, char *buffer) {
+    return cache_copy(sector, 0, buffer, SECTOR_SIZE);
+}
+
+// overwrite 'n' bytes from 'offset' on of a sector through the cache
+// (the rest of the sector is preserved, even if other threads change
+// it at the same time); return 0 if successful, -1 otherwise
+static int cache_patch(int sector, int offset, char *buffer, int n) {
+    pthread_mutex_lock(&cache_lock);
+    char *data = cache_get(sector);
+    if (data) {
+        memcpy(data + offset, buffer, (size_t) n);
+        cache[cache_lookup(sector)].dirty = 1;
+        CACHE_CHANGE(sector);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return data ? 0 : -1;
+}
+
+// write a sector through the cache; same interface as Disk_Write(),
+// but the disk itself is only updated later
+static int cache_write(int sector, char *buffer) {
+    if (sector < 0 || sector >= TOTAL_SECTORS) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    pthread_mutex_lock(&cache_lock);
+    int slot = cache_find(sector);
+    if (slot >= 0) {
+        cache_hits++;
+    } else {
+        // no need to read the old content, it's overwritten entirely
+        cache_misses++;
+        if ((slot = cache_evict()) < 0) {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        cache_insert(slot, sector);
+    }
+    cache[slot].used = 1;
+    cache[slot].dirty = 1;
+    memcpy(cache[slot].data, buffer, SECTOR_SIZE);
+    CACHE_CHANGE(sector);
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// forget 'n' sectors starting from 'sector' that have been freed: they
+// are dropped from the cache without being written back, and left out
+// of the next commit, as their content no longer matters
+static void cache_discard(int sector, int n) {
+    pthread_mutex_lock(&cache_lock);
+    for (int s = sector; s < sector + n; s++) {
+        int slot = cache_find(s);
+        if (slot >= 0) {
+            cache_unhash(slot);
+            cache[slot].sector = -1;
+            cache[slot].dirty = 0;
+            cache[slot].used = 0;
+        }
+        cache_changed[s / 64] &= ~(1ULL << (s % 64));
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// write all modified sectors back to the disk; return 0 if
+// successful, -1 otherwise
+static int cache_flush() {
+    int err = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < CACHE_SECTORS && !err; i++) {
+        if (cache[i].sector >= 0 && cache[i].dirty) {
+            if (Disk_Write(cache[i].sector, cache[i].data) < 0)
+                err = -1;
+            else
+                cache[i].dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return err;
+}
+
+// return the sectors modified since the last call (or since the cache
+// was reset): their numbers and contents are handed out through
+// 'sectors' and 'data', to be freed by the caller, and their number is
+// returned; return -1 (with nothing handed out) on error
+static int cache_changes(int **sectors, char **data) {
+    uint64_t changed[(TOTAL_SECTORS + 63) / 64]; // sectors changed meanwhile are left for next time
+    int count = 0;
+    *sectors = NULL;
+    *data = NULL;
+    pthread_mutex_lock(&cache_lock);
+    memcpy(changed, cache_changed, sizeof(changed));
+    for (int w = 0; w < (TOTAL_SECTORS + 63) / 64; w++)
+        count += __builtin_popcountll(changed[w]);
+    if (count > 0 && (!(*sectors = malloc(count * sizeof(int))) ||
+                      !(*data = malloc((size_t) count * SECTOR_SIZE)))) {
+        pthread_mutex_unlock(&cache_lock);
+        free(*sectors);
+        *sectors = NULL;
+        return -1;
+    }
+    for (int w = 0; w < (TOTAL_SECTORS + 63) / 64; w++)
+        cache_changed[w] &= ~changed[w];
+    int n = 0;
+    for (int w = 0; w < (TOTAL_SECTORS + 63) / 64; w++) {
+        for (uint64_t bits = changed[w]; bits; bits &= bits - 1) {
+            int sector = w * 64 + __builtin_ctzll(bits);
+            char *dst = *data + n * SECTOR_SIZE;
+            // sectors no longer cached have been written to the disk
+            int slot = cache_find(sector);
+            if (slot >= 0) {
+                memcpy(dst, cache[slot].data, SECTOR_SIZE);
+            } else if (Disk_Read(sector, dst) < 0) {
+                for (int i = 0; i < (TOTAL_SECTORS + 63) / 64; i++)
+                    cache_changed[i] |= changed[i];
+                pthread_mutex_unlock(&cache_lock);
+                free(*sectors);
+                free(*data);
+                *sectors = NULL;
+                *data = NULL;
+                return -1;
+            }
+            (*sectors)[n++] = sector;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return count;
+}
+
+// count sectors handed out by cache_changes() as modified again, when
+// they couldn't be committed after all
+static void cache_unchange(int *sectors, int n) {
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < n; i++)
+        CACHE_CHANGE(sectors[i]);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// collect the asynchronous requests that have completed, if no other
+// thread is waiting for them; the caller holds 'cache_lock'
+static void cache_collect() {
+    if (cache_inflight > 0 && !cache_reaping) {
+        Disk_Request_t *done[CACHE_SECTORS];
+        int n = Disk_QueuePoll(cache_queue, done, CACHE_SECTORS);
+        if (n > 0) cache_complete(done, n);
+    }
+}
+
+// submit an asynchronous request on behalf of another part of the file
+// system; like a direct transfer, its 'data' points to a counter that
+// is decremented on completion (see cache_poll()); return 0 if
+// successful, -1 otherwise
+static int cache_submit(Disk_Request_t *req) {
+    pthread_mutex_lock(&cache_lock);
+    req->queue = cache_queue;
+    int n = Disk_Submit(&req, 1);
+    if (n > 0) cache_inflight++;
+    pthread_mutex_unlock(&cache_lock);
+    return n > 0 ? 0 : -1;
+}
+
+// collect the completed asynchronous requests without waiting and
+// return the current value of a counter (see cache_submit())
+static int cache_poll(int *counter) {
+    pthread_mutex_lock(&cache_lock);
+    cache_collect();
+    int n = *counter;
+    pthread_mutex_unlock(&cache_lock);
+    return n;
+}
+
+// wait until a counter (see cache_submit()) drops to zero
+static void cache_wait(int *counter) {
+    pthread_mutex_lock(&cache_lock);
+    while (*counter > 0)
+        cache_progress();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// the most sectors read ahead, or read directly, at once
+#define READ_BATCH 64
+
+// start reading up to 'n' consecutive sectors from 'sector' on into
+// the cache in the background, skipping those already cached; at most
+// half of the cache is left pending, so that there's always room
+static void cache_readahead(int sector, int n) {
+    Disk_Request_t *reqs[READ_BATCH];
+    int count = 0;
+    pthread_mutex_lock(&cache_lock);
+    cache_collect();
+    for (int i = sector; i < sector + n && count < READ_BATCH; i++) {
+        if (cache_inflight + count >= CACHE_SECTORS / 2) break;
+        if (cache_lookup(i) >= 0) continue;
+        int slot = cache_evict();
+        if (slot < 0) break;
+        cache_insert(slot, i);
+        cache[slot].pending = 1;
+        cache[slot].req.op = DISK_OP_READ;
+        cache[slot].req.sector = i;
+        cache[slot].req.buffer = cache[slot].data;
+        cache[slot].req.data = NULL;
+        cache[slot].req.queue = cache_queue;
+        reqs[count++] = &cache[slot].req;
+    }
+    if (count > 0 && Disk_Submit(reqs, count) < 0) {
+        for (int i = 0; i < count; i++) {
+            buf_t *b = (buf_t *) ((char *) reqs[i] - offsetof(buf_t, req));
+            b->pending = 0;
+            cache_unhash((int) (b - cache));
+            b->sector = -1;
+        }
+    } else if (count > 0) {
+        cache_inflight += count;
+        dprintf("... read ahead %d sectors from sector %d\n", count, sector);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// read 'n' consecutive sectors from 'sector' on into 'buffer'; those in
+// the cache are copied from there, the others are transferred from the
+// disk straight into the buffer without being cached; return 0 if
+// successful, -1 otherwise
+static int cache_read_direct(int sector, int n, char *buffer) {
+    Disk_Request_t reqs[READ_BATCH], *batch[READ_BATCH];
+    int err = 0;
+    pthread_mutex_lock(&cache_lock);
+    while (n > 0 && !err) {
+        int count = 0, outstanding = 0, done = 0;
+        for (; done < n && count < READ_BATCH; done++) {
+            int slot = cache_find(sector + done);
+            if (slot >= 0) {
+                cache_hits++;
+                cache[slot].used = 1;
+                memcpy(buffer + done * SECTOR_SIZE, cache[slot].data, SECTOR_SIZE);
+                continue;
+            }
+            cache_misses++;
+            reqs[count].op = DISK_OP_READ;
+            reqs[count].sector = sector + done;
+            reqs[count].buffer = buffer + done * SECTOR_SIZE;
+            reqs[count].data = &outstanding;
+            reqs[count].queue = cache_queue;
+            batch[count] = &reqs[count];
+            count++;
+        }
+        if (count > 0) {
+            outstanding = count;
+            if (Disk_Submit(batch, count) < 0) {
+                err = -1;
+                break;
+            }
+            cache_inflight += count;
+            while (outstanding > 0)
+                cache_progress();
+            for (int i = 0; i < count; i++) {
+                if (reqs[i].result < 0) {
+                    diskErrno = reqs[i].error;
+                    err = -1;
+                }
+            }
+        }
+        sector += done;
+        buffer += done * SECTOR_SIZE;
+        n -= done;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return err;
+}
+
+// the inode cache keeps the inodes in use in memory (in-core inodes)
+// so that each is read from the inode table and parsed only once while
+// it's being used; callers get an in-core inode with iget() and give it
+// back with iput(); a modified inode is marked dirty and written back
+// to the inode table when its file is closed, when it's evicted from
+// the cache, or by FS_Sync(); inodes nobody references any more stay
+// cached, in LRU order, up to ICACHE_UNUSED of them; 'icache_lock'
+// protects the cache itself and the reference counts, while the content
+// of an in-core inode is protected by its own reader/writer lock
+#define ICACHE_BUCKETS 256
+#define ICACHE_UNUSED 256
+
+// a directory that's been searched while in core also gets an index:
+// a hash table of its entries by name, built from the dirent sectors on
+// the first lookup and then kept up to date as entries are added and
+// removed; the entries of a directory are always packed, so slot 'i'
+// of the index describes the i-th dirent
+typedef struct _dirslot {
+    char fname[MAX_NAME]; // name of the entry
+    int inode;            // inode of the entry
+    int next;             // next slot in the same hash bucket (-1 ends the chain)
+} dirslot_t;
+
+typedef struct _dirindex {
+    int nslots;       // capacity of 'slots'
+    int nbuckets;     // number of hash buckets (a power of two)
+    int *buckets;     // first slot of each hash chain
+    dirslot_t *slots; // one per directory entry
+} dirindex_t;
+
+static void dir_index_free(dirindex_t *dx) {
+    if (!dx) return;
+    free(dx->buckets);
+    free(dx->slots);
+    free(dx);
+}
+
+// the extents of an in-core inode, direct and indirect ones alike, are
+// gathered in one array (the extent map) when its blocks are first
+// looked up, so that the indirect blocks are only read once
+typedef struct _mextent {
+    int first; // first file block of the extent
+    int start; // first disk sector of the extent
+    int len;   // number of sectors
+} mextent_t;
+
+typedef struct _minode {
+    pthread_rwlock_t lock; // protects everything below but the links
+    int inode; // the inode number
+    int refs;  // number of references handed out by iget()
+    int opens; // number of descriptors the file is open with (under 'icache_lock')
+    int dirty; // 1 if modified since read from the inode table
+    inode_t d; // the inode itself
+    dirindex_t *dir; // index of the entries (directories only, may be NULL)
+    mextent_t *map;  // the extent map (NULL until needed)
+    int mapsize;     // capacity of the extent map
+    int maphint;     // extent of the last block looked up
+    char *wbuf;      // data written but not yet placed on disk (files only)
+    int wpos;        // file position of the data in 'wbuf'
+    int wlen;        // number of bytes in 'wbuf'
+    int wres;        // sectors reserved for it (see wbuf_reserve())
+    struct _open_file *streams;  // streams open on the directory (see Dir_Open())
+    struct _minode *hnext;       // next in the same hash bucket
+    struct _minode *prev, *next; // neighbors on the unused list
+} minode_t;
+
+// representing an open file, or an open directory stream
+typedef struct _open_file {
+    int inode;     // pointing to the inode of the file or directory
+    minode_t *ip;  // the in-core inode, referenced while open (NULL means entry not used)
+    int dir;       // 1 if a directory stream, 0 if a file
+    int pos;       // read/write position (the next entry of a directory stream)
+    int ra_next;   // block where the next read starts if reading sequentially
+    int ra_end;    // first block not read ahead yet
+    int ra_window; // number of blocks to keep read ahead (0 if not sequential)
+    struct _open_file *snext; // next stream open on the same directory
+} open_file_t;
+
+static minode_t *icache_buckets[ICACHE_BUCKETS];
+static minode_t icache_unused = {.prev = &icache_unused, .next = &icache_unused};
+static int icache_nunused;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the disk sector of the inode table containing the given inode
+#define INODE_SECTOR(inode) (INODE_TABLE_START_SECTOR + (inode) / INODES_PER_SECTOR)
+
+// write an in-core inode back to the inode table; the caller holds the
+// inode's lock, or the only reference to it
+static int iupdate(minode_t *ip) {
+    int sector = INODE_SECTOR(ip->inode);
+    if (cache_patch(sector, (int) ((ip->inode % INODES_PER_SECTOR) * sizeof(inode_t)),
+                    (char *) &ip->d, sizeof(inode_t)) < 0)
+        return -1;
+    dprintf("... write back inode %d (size=%d, type=%d) to disk sector %d\n",
+            ip->inode, ip->d.size, ip->d.type, sector);
+    ip->dirty = 0;
+    return 0;
+}
+
+static void icache_unlink(minode_t *ip) {
+    ip->prev->next = ip->next;
+    ip->next->prev = ip->prev;
+    icache_nunused--;
+}
+
+static void icache_unhash(minode_t *ip) {
+    minode_t **link = &icache_buckets[ip->inode % ICACHE_BUCKETS];
+    while (*link != ip)
+        link = &(*link)->hnext;
+    *link = ip->hnext;
+}
+
+static void ifree(minode_t *ip) {
+    dir_index_free(ip->dir);
+    free(ip->map);
+    free(ip->wbuf);
+    pthread_rwlock_destroy(&ip->lock);
+    free(ip);
+}
+
+// drop all in-core inodes without writing them back (used when the
+// disk is reloaded)
+static void icache_reset() {
+    for (int i = 0; i < ICACHE_BUCKETS; i++) {
+        while (icache_buckets[i]) {
+            minode_t *ip = icache_buckets[i];
+            icache_buckets[i] = ip->hnext;
+            ifree(ip);
+        }
+    }
+    icache_unused.prev = icache_unused.next = &icache_unused;
+    icache_nunused = 0;
+}
+
+// get the in-core inode of the given inode number, reading it from the
+// inode table if it isn't cached; returns NULL on error
+static minode_t *iget(int inode) {
+    if (inode < 0 || inode >= MAX_FILES) return NULL;
+    minode_t *ip;
+    pthread_mutex_lock(&icache_lock);
+    for (ip = icache_buckets[inode % ICACHE_BUCKETS]; ip; ip = ip->hnext) {
+        if (ip->inode == inode) {
+            if (ip->refs++ == 0) icache_unlink(ip);
+            pthread_mutex_unlock(&icache_lock);
+            return ip;
+        }
+    }
+
+    char buf[SECTOR_SIZE];
+    if (cache_read(INODE_SECTOR(inode), buf) < 0 || (ip = calloc(1, sizeof(minode_t))) == NULL) {
+        pthread_mutex_unlock(&icache_lock);
+        return NULL;
+    }
+    pthread_rwlock_init(&ip->lock, NULL);
+    ip->inode = inode;
+    ip->refs = 1;
+    memcpy(&ip->d, buf + (inode % INODES_PER_SECTOR) * sizeof(inode_t), sizeof(inode_t));
+    dprintf("... load inode %d (size=%d, type=%d) from disk sector %d\n",
+            inode, ip->d.size, ip->d.type, INODE_SECTOR(inode));
+    ip->hnext = icache_buckets[inode % ICACHE_BUCKETS];
+    icache_buckets[inode % ICACHE_BUCKETS] = ip;
+    pthread_mutex_unlock(&icache_lock);
+    return ip;
+}
+
+// give back a reference obtained from iget(); the caller must not hold
+// the inode's lock
+static void iput(minode_t *ip) {
+    pthread_mutex_lock(&icache_lock);
+    if (--ip->refs > 0) {
+        pthread_mutex_unlock(&icache_lock);
+        return;
+    }
+
+    // keep it around as the most recently used
+    ip->prev = icache_unused.prev;
+    ip->next = &icache_unused;
+    icache_unused.prev->next = ip;
+    icache_unused.prev = ip;
+    icache_nunused++;
+
+    // and evict the least recently used one if there are too many
+    if (icache_nunused > ICACHE_UNUSED) {
+        minode_t *victim = icache_unused.next;
+        if (!victim->dirty || iupdate(victim) == 0) {
+            icache_unlink(victim);
+            icache_unhash(victim);
+            ifree(victim);
+        } // otherwise try again later
+    }
+    pthread_mutex_unlock(&icache_lock);
+}
+
+// count a file descriptor opened (n=1) or closed (n=-1) on a file
+static void iopen(minode_t *ip, int n) {
+    pthread_mutex_lock(&icache_lock);
+    ip->opens += n;
+    pthread_mutex_unlock(&icache_lock);
+}
+
+// return the number of file descriptors open on the given inode; an
+// open file stays in core, so only the cached inodes need be checked
+static int iopens(int inode) {
+    int opens = 0;
+    pthread_mutex_lock(&icache_lock);
+    for (minode_t *ip = icache_buckets[inode % ICACHE_BUCKETS]; ip; ip = ip->hnext) {
+        if (ip->inode == inode) {
+            opens = ip->opens;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&icache_lock);
+    return opens;
+}
+
+// return all the in-core inodes, each with a reference taken, and
+// their number through 'n' (-1 if out of memory)
+static minode_t **icache_all(int *n) {
+    pthread_mutex_lock(&icache_lock);
+    int count = 0;
+    for (int i = 0; i < ICACHE_BUCKETS; i++) {
+        for (minode_t *ip = icache_buckets[i]; ip; ip = ip->hnext)
+            count++;
+    }
+    minode_t **list = count ? malloc(count * sizeof(minode_t *)) : NULL;
+    *n = count && !list ? -1 : 0;
+    for (int i = 0; list && i < ICACHE_BUCKETS; i++) {
+        for (minode_t *ip = icache_buckets[i]; ip; ip = ip->hnext) {
+            if (ip->refs++ == 0) icache_unlink(ip);
+            list[(*n)++] = ip;
+        }
+    }
+    pthread_mutex_unlock(&icache_lock);
+    return list;
+}
 
 // check magic number in the superblock; return 1 if OK, and 0 if not
 static int check_magic() {
     char buf[SECTOR_SIZE];
-    if (Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0)
+    if (cache_read(SUPERBLOCK_START_SECTOR, buf) < 0)
         return 0;
-    if (*(int *) buf == OS_MAGIC) return 1;
+    if (((int *) buf)[0] == OS_MAGIC && ((int *) buf)[1] == OS_VERSION) return 1;
     else return 0;
 }
 
+// the inode bitmap and the sector bitmap are kept in memory while the
+// file system is booted: they are searched a 64-bit word at a time,
+// starting from the word where the last free bit was found, and only
+// written back (to the buffer cache) by FS_Sync(); on disk, bit 'i'
+// is the (7 - i%8)-th bit of byte i/8, so a word loaded in big-endian
+// order has the bits in index order from its most significant end
+typedef struct _bitmap {
+    int start;       // first disk sector of the bitmap
+    int num;         // number of sectors
+    int nbits;       // number of bits in use
+    int hint;        // word to start looking for a zero bit
+    int dirty;       // one bit per sector modified since written back
+    int nfree;       // number of zero bits
+    int reserved;    // zero bits set aside for their owners (see bitmap_avail())
+    uint64_t *words; // the bitmap, in the byte order of the disk
+    pthread_mutex_t lock;
+} bitmap_t;
+
+#define WORDS_PER_SECTOR (SECTOR_SIZE / sizeof(uint64_t))
+
+static uint64_t inode_bitmap_words[INODE_BITMAP_SECTORS * WORDS_PER_SECTOR];
+static uint64_t sector_bitmap_words[SECTOR_BITMAP_SECTORS * WORDS_PER_SECTOR];
+static bitmap_t inode_bitmap = {INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, MAX_FILES,
+                                0, 0, 0, 0, inode_bitmap_words, PTHREAD_MUTEX_INITIALIZER};
+static bitmap_t sector_bitmap = {SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, TOTAL_SECTORS,
+                                 0, 0, 0, 0, sector_bitmap_words, PTHREAD_MUTEX_INITIALIZER};
+
+// the reserved bits the calling thread may take itself (while it writes
+// out the data they were set aside for)
+static __thread int bitmap_mine;
+
+// convert between the disk byte order and big-endian words
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BITMAP_WORD(w) __builtin_bswap64(w)
+#else
+#define BITMAP_WORD(w) (w)
+#endif
+
 // initialize a bitmap with 'num' sectors starting from 'start'
 // sector; all bits should be set to zero except that the first
 // 'nbits' number of bits are set to one
 static void bitmap_init(int start, int num, int nbits) {
-    char *buffer = calloc(SECTOR_SIZE, sizeof(char));
-    unsigned char allOnes = 255;
-    int bitsInBuffer = SECTOR_SIZE * 8;
+    unsigned char buffer[SECTOR_SIZE];
+    int bitsInBuffer = SECTOR_SIZE * BYTE;
 
     for (int i = 0; i < num; i++) {
-        // if bits to be set to one is greater than total bits in buffer
+        memset(buffer, 0, SECTOR_SIZE);
         if (nbits >= bitsInBuffer) {
             //set all bits to one
-            memset(buffer, allOnes, SECTOR_SIZE);
-            nbits = nbits - bitsInBuffer;
+            memset(buffer, 0xff, SECTOR_SIZE);
+            nbits -= bitsInBuffer;
         } else if (nbits > 0) {
-            // set only necessary bits
-            free(buffer);
-            buffer = calloc(SECTOR_SIZE, sizeof(char));
-            int numOfCharsToSet = nbits / 8;
-
-            memset(buffer, allOnes, (size_t) numOfCharsToSet);
-            nbits = nbits - (numOfCharsToSet * 8);
-
-            // set remaining bits to one
-            for (int j = 0; j < 7; j++) {
-                if (nbits) {
-                    buffer[numOfCharsToSet] |= 1;
-                    nbits--;
+            // set only necessary bits: whole bytes, then the leading
+            // bits of the next one
+            memset(buffer, 0xff, (size_t) (nbits / BYTE));
+            if (nbits % BYTE)
+                buffer[nbits / BYTE] = (unsigned char) (0xff << (BYTE - nbits % BYTE));
+            nbits = 0;
+        }
+        cache_write(start + i, (char *) buffer);
+    }
+}
+
+// read a bitmap from the disk into memory
+static int bitmap_load(bitmap_t *bm) {
+    int err = 0;
+    pthread_mutex_lock(&bm->lock);
+    for (int i = 0; i < bm->num && !err; i++) {
+        if (cache_read(bm->start + i, (char *) (bm->words + i * WORDS_PER_SECTOR)) < 0)
+            err = -1;
+    }
+    bm->hint = 0;
+    bm->dirty = 0;
+    bm->nfree = bm->nbits; // the bits past the end are never set
+    for (int w = 0; w < (bm->nbits + 63) / 64; w++)
+        bm->nfree -= __builtin_popcountll(bm->words[w]);
+    bm->reserved = 0;
+    pthread_mutex_unlock(&bm->lock);
+    return err;
+}
+
+// return the number of bits the calling thread may set: the free ones
+// that aren't reserved, plus those reserved for it; the caller holds
+// the lock
+static int bitmap_avail(bitmap_t *bm) {
+    int mine = bitmap_mine < bm->reserved ? bitmap_mine : bm->reserved;
+    return bm->nfree - bm->reserved + mine;
+}
+
+// account for 'n' bits just set, which come out of the calling thread's
+// reservation first; the caller holds the lock
+static void bitmap_taken(bitmap_t *bm, int n) {
+    int mine = bitmap_mine < bm->reserved ? bitmap_mine : bm->reserved;
+    if (mine > n) mine = n;
+    bm->nfree -= n;
+    bm->reserved -= mine;
+    bitmap_mine -= mine;
+}
+
+// write the modified sectors of a bitmap back to the disk
+static int bitmap_sync(bitmap_t *bm) {
+    pthread_mutex_lock(&bm->lock);
+    for (int i = 0; i < bm->num; i++) {
+        if (bm->dirty & (1 << i)) {
+            if (cache_write(bm->start + i, (char *) (bm->words + i * WORDS_PER_SECTOR)) < 0) {
+                pthread_mutex_unlock(&bm->lock);
+                return -1;
+            }
+            bm->dirty &= ~(1 << i);
+        }
+    }
+    pthread_mutex_unlock(&bm->lock);
+    return 0;
+}
+
+// set the first unused bit from a bitmap (flip the first zero appeared
+// in the bitmap to one) and return its location; return -1 if the
+// bitmap is already full (no more zeros)
+static int bitmap_first_unused(bitmap_t *bm) {
+    int nwords = (bm->nbits + 63) / 64;
+    pthread_mutex_lock(&bm->lock);
+    if (bitmap_avail(bm) < 1) nwords = 0; // what's left is reserved
+    // words before the hint have been full since it was last moved
+    // back, so start from there and only wrap around to be sure
+    for (int n = 0; n < nwords; n++) {
+        int w = (bm->hint + n) % nwords;
+        uint64_t free = ~BITMAP_WORD(bm->words[w]);
+        if (!free) continue;
+        int ibit = w * 64 + __builtin_clzll(free);
+        if (ibit >= bm->nbits) continue;
+        bm->words[w] |= BITMAP_WORD(1ULL << (63 - ibit % 64));
+        bm->dirty |= 1 << (ibit / (SECTOR_SIZE * BYTE));
+        bm->hint = w;
+        bitmap_taken(bm, 1);
+        pthread_mutex_unlock(&bm->lock);
+        return ibit;
+    }
+    pthread_mutex_unlock(&bm->lock);
+    return -1;
+}
+
+// set up to 'want' unused bits of a bitmap, found in one pass over it
+// as in bitmap_first_unused(), and store their locations in 'bits';
+// return the number of bits set, fewer than 'want' if it fills up
+static int bitmap_alloc_many(bitmap_t *bm, int want, int *bits) {
+    int nwords = (bm->nbits + 63) / 64, got = 0;
+    pthread_mutex_lock(&bm->lock);
+    if (want > bitmap_avail(bm)) want = bitmap_avail(bm);
+    for (int n = 0; n < nwords && got < want; n++) {
+        int w = (bm->hint + n) % nwords;
+        uint64_t free = ~BITMAP_WORD(bm->words[w]);
+        while (free && got < want) {
+            int ibit = w * 64 + __builtin_clzll(free);
+            if (ibit >= bm->nbits) break;
+            free &= ~(1ULL << (63 - ibit % 64));
+            bm->words[w] |= BITMAP_WORD(1ULL << (63 - ibit % 64));
+            bm->dirty |= 1 << (ibit / (SECTOR_SIZE * BYTE));
+            bits[got++] = ibit;
+        }
+        if (got) bm->hint = w;
+    }
+    bitmap_taken(bm, got);
+    pthread_mutex_unlock(&bm->lock);
+    return got;
+}
+
+// reset the i-th bit of a bitmap with its lock held
+static int bitmap_clear(bitmap_t *bm, int ibit) {
+    // check if ibit is within boundaries
+    if (ibit < 0 || ibit >= bm->nbits) {
+        return -1;
+    }
+    uint64_t bit = BITMAP_WORD(1ULL << (63 - ibit % 64));
+    if (bm->words[ibit / 64] & bit) bm->nfree++;
+    bm->words[ibit / 64] &= ~bit;
+    bm->dirty |= 1 << (ibit / (SECTOR_SIZE * BYTE));
+    if (ibit / 64 < bm->hint) bm->hint = ibit / 64;
+    return 0;
+}
+
+// reset the i-th bit of a bitmap; return 0 if successful, -1 otherwise
+static int bitmap_reset(bitmap_t *bm, int ibit) {
+    pthread_mutex_lock(&bm->lock);
+    int err = bitmap_clear(bm, ibit);
+    pthread_mutex_unlock(&bm->lock);
+    return err;
+}
+
+// reset 'len' bits of a bitmap starting from the 'ibit'-th
+static void bitmap_reset_run(bitmap_t *bm, int ibit, int len) {
+    pthread_mutex_lock(&bm->lock);
+    for (int i = ibit; i < ibit + len; i++)
+        bitmap_clear(bm, i);
+    pthread_mutex_unlock(&bm->lock);
+}
+
+// return the number of consecutive zero bits starting from 'ibit', but
+// no more than 'max'
+static int bitmap_free_run(bitmap_t *bm, int ibit, int max) {
+    int n = 0;
+    while (n < max && ibit + n < bm->nbits) {
+        int b = ibit + n;
+        int left = 64 - b % 64; // bits from b to the end of its word
+        uint64_t w = BITMAP_WORD(bm->words[b / 64]) << (b % 64);
+        int zeros = w ? __builtin_clzll(w) : 64;
+        if (zeros < left) {
+            n += zeros; // ran into a one
+            break;
+        }
+        n += left;
+    }
+    if (n > max) n = max;
+    if (n > bm->nbits - ibit) n = bm->nbits - ibit;
+    return n;
+}
+
+// allocate a run of up to 'want' consecutive bits, preferably starting
+// at 'goal' (if it's positive), otherwise the first run that is long
+// enough, or failing that, the longest run found; the bits are set and
+// the start of the run is returned, its length through 'len'; return
+// -1 if the bitmap is full (or what's left is reserved)
+static int bitmap_alloc_run(bitmap_t *bm, int goal, int want, int *len) {
+    int best = -1, bestlen = 0;
+    pthread_mutex_lock(&bm->lock);
+    if (want > bitmap_avail(bm)) want = bitmap_avail(bm);
+    if (want <= 0) {
+        pthread_mutex_unlock(&bm->lock);
+        return -1;
+    }
+    if (goal > 0 && goal < bm->nbits) {
+        bestlen = bitmap_free_run(bm, goal, want);
+        if (bestlen > 0) best = goal;
+    }
+
+    // first fit, skipping full words; words before the hint are full
+    int p = bm->hint * 64;
+    while (bestlen < want && p < bm->nbits) {
+        int w = p / 64;
+        uint64_t word = BITMAP_WORD(bm->words[w]);
+        if (p % 64) word |= ~0ULL << (64 - p % 64); // ignore bits before p
+        if (!~word) {
+            p = (w + 1) * 64;
+            continue;
+        }
+        int ibit = w * 64 + __builtin_clzll(~word);
+        if (ibit >= bm->nbits) break;
+        int n = bitmap_free_run(bm, ibit, want);
+        if (n > bestlen) {
+            best = ibit;
+            bestlen = n;
+        }
+        p = ibit + n + 1; // the bit after the run is set (or past the end)
+    }
+    if (best < 0) {
+        pthread_mutex_unlock(&bm->lock);
+        return -1;
+    }
+
+    for (int i = best; i < best + bestlen; i++) {
+        bm->words[i / 64] |= BITMAP_WORD(1ULL << (63 - i % 64));
+        bm->dirty |= 1 << (i / (SECTOR_SIZE * BYTE));
+    }
+    bitmap_taken(bm, bestlen);
+    pthread_mutex_unlock(&bm->lock);
+    *len = bestlen;
+    return best;
+}
+
+// return the disk sector holding extent 'i' of a file (which must be
+// an indirect one), allocating the indirect blocks leading to it if
+// 'alloc' is set; return 0 if they aren't there, -1 on error
+static int extent_sector(minode_t *ip, int i, int alloc) {
+    int zero[POINTERS_PER_SECTOR];
+    memset(zero, 0, SECTOR_SIZE);
+    i -= DIRECT_EXTENTS;
+    int *ptr = &ip->d.indirect;
+    int pointers[POINTERS_PER_SECTOR], slot = -1;
+    if (i >= EXTENTS_PER_SECTOR) {
+        // find the indirect block in the double-indirect block
+        i -= EXTENTS_PER_SECTOR;
+        if (!ip->d.dindirect) {
+            if (!alloc) return 0;
+            int sector = bitmap_first_unused(&sector_bitmap);
+            if (sector < 0 || cache_write(sector, (char *) zero) < 0) return -1;
+            ip->d.dindirect = sector;
+            ip->dirty = 1;
+        }
+        if (cache_read(ip->d.dindirect, (char *) pointers) < 0) return -1;
+        slot = i / EXTENTS_PER_SECTOR;
+        ptr = &pointers[slot];
+    }
+    if (!*ptr) {
+        if (!alloc) return 0;
+        int sector = bitmap_first_unused(&sector_bitmap);
+        if (sector < 0 || cache_write(sector, (char *) zero) < 0) return -1;
+        *ptr = sector;
+        if (slot < 0) ip->dirty = 1;
+        else if (cache_write(ip->d.dindirect, (char *) pointers) < 0) return -1;
+        dprintf("... new indirect block %d for inode %d\n", sector, ip->inode);
+    }
+    return *ptr;
+}
+
+// build the extent map of an in-core inode if it doesn't have one;
+// return 0 if successful, -1 otherwise
+static int inode_map(minode_t *ip) {
+    if (ip->map) return 0;
+    int n = ip->d.nextents;
+    int size = n > 16 ? n : 16;
+    mextent_t *map = malloc(size * sizeof(mextent_t));
+    if (!map) return -1;
+    extent_t ext[EXTENTS_PER_SECTOR];
+    int first = 0;
+    for (int i = 0; i < n; i++) {
+        extent_t *e;
+        if (i < DIRECT_EXTENTS) {
+            e = &ip->d.ext[i];
+        } else {
+            int k = (i - DIRECT_EXTENTS) % EXTENTS_PER_SECTOR;
+            if (k == 0) {
+                int sector = extent_sector(ip, i, 0);
+                if (sector <= 0 || cache_read(sector, (char *) ext) < 0) {
+                    free(map);
+                    return -1;
                 }
-                buffer[numOfCharsToSet] = buffer[numOfCharsToSet] << 1;
             }
+            e = &ext[k];
         }
-        Disk_Write(start + i, buffer);
+        map[i].first = first;
+        map[i].start = e->start;
+        map[i].len = e->len;
+        first += e->len;
     }
+    ip->map = map;
+    ip->mapsize = size;
+    ip->maphint = 0;
+    return 0;
 }
 
-// set the first unused bit from a bitmap of 'nbits' bits (flip the
-// first zero appeared in the bitmap to one) and return its location;
-// return -1 if the bitmap is already full (no more zeros)
-static int bitmap_first_unused(int start, int num, int nbits) {
-    char buffer[SECTOR_SIZE];
-    // read each sector until zero bit it's found
-    for (int i = 0; i < num; i++) {
-        Disk_Read(start + i, buffer);
-        // iterate over each char
-        for (int j = 0; j < SECTOR_SIZE; j++) {
-            // iterate over each bit on the char and track
-            // how many bits have been checked so far
-            for (int k = 7; k >= 0 && nbits > 0; k--) {
-                int zero = (buffer[j] >> k) & 1;
-                nbits--;
-                // found a zero
-                if (!zero) {
-                    int mask = 1;
-                    mask = mask << k;
-                    buffer[j] |= mask; // set bit to 1
-                    Disk_Write(start + i, buffer);
-                    // return position
-                    return (i * SECTOR_SIZE * 8) + (j * 8) + (7 - k);
+// write extent 'i' of the extent map to where it belongs on disk;
+// return 0 if successful, -1 otherwise
+static int extent_store(minode_t *ip, int i) {
+    extent_t e = {ip->map[i].start, ip->map[i].len};
+    if (i < DIRECT_EXTENTS) {
+        ip->d.ext[i] = e;
+        ip->dirty = 1;
+        return 0;
+    }
+    extent_t ext[EXTENTS_PER_SECTOR];
+    int sector = extent_sector(ip, i, 1);
+    if (sector <= 0 || cache_read(sector, (char *) ext) < 0) return -1;
+    ext[(i - DIRECT_EXTENTS) % EXTENTS_PER_SECTOR] = e;
+    return cache_write(sector, (char *) ext);
+}
+
+// return the disk sector holding data block 'idx' of a file, or -1 if
+// the file doesn't have that many blocks; the number of blocks stored
+// consecutively on disk from there (itself included) is returned
+// through 'run' if it's not NULL
+static int inode_block(minode_t *ip, int idx, int *run) {
+    if (inode_map(ip) < 0) return -1;
+    int n = ip->d.nextents;
+    mextent_t *map = ip->map;
+    // readers share the inode lock, so the hint is only ever a guess
+    int i = __atomic_load_n(&ip->maphint, __ATOMIC_RELAXED);
+    if (i >= n || idx < map[i].first || idx >= map[i].first + map[i].len) {
+        // not in the same extent as last time; binary search
+        int lo = 0, hi = n - 1;
+        i = -1;
+        while (lo <= hi) {
+            int mid = (lo + hi) / 2;
+            if (idx < map[mid].first) hi = mid - 1;
+            else if (idx >= map[mid].first + map[mid].len) lo = mid + 1;
+            else {
+                i = mid;
+                break;
+            }
+        }
+        if (i < 0) return -1;
+        __atomic_store_n(&ip->maphint, i, __ATOMIC_RELAXED);
+    }
+    if (run) *run = map[i].first + map[i].len - idx;
+    return map[i].start + idx - map[i].first;
+}
+
+// return the number of data blocks allocated to a file
+static int inode_nblocks(minode_t *ip) {
+    if (inode_map(ip) < 0 || !ip->d.nextents) return 0;
+    mextent_t *last = &ip->map[ip->d.nextents - 1];
+    return last->first + last->len;
+}
+
+// make sure a file has at least 'nblocks' data blocks; the missing ones
+// are allocated in as few runs as possible, each placed right after the
+// file's last block when there's room so that the last extent simply
+// grows; return 0 if successful, -1 if the disk is full or the file
+// has run out of extents (the blocks allocated so far are kept); the
+// content must not be inline (see inode_uninline())
+static int inode_grow(minode_t *ip, int nblocks) {
+    if (inode_map(ip) < 0) return -1;
+    int have = inode_nblocks(ip);
+    while (have < nblocks) {
+        int n = ip->d.nextents;
+        mextent_t *last = n ? &ip->map[n - 1] : NULL;
+        int goal = last ? last->start + last->len : 0;
+        int len;
+        int start = bitmap_alloc_run(&sector_bitmap, goal, nblocks - have, &len);
+        if (start < 0) {
+            dprintf("... no free sectors left\n");
+            return -1;
+        }
+        int err;
+        if (last && start == goal) {
+            last->len += len;
+            if ((err = extent_store(ip, n - 1)) < 0) last->len -= len;
+        } else if (n < MAX_EXTENTS) {
+            if (n == ip->mapsize) {
+                mextent_t *map = realloc(ip->map, 2 * n * sizeof(mextent_t));
+                if (!map) {
+                    bitmap_reset_run(&sector_bitmap, start, len);
+                    return -1;
                 }
+                ip->map = map;
+                ip->mapsize = 2 * n;
             }
+            ip->map[n].first = have;
+            ip->map[n].start = start;
+            ip->map[n].len = len;
+            if ((err = extent_store(ip, n)) == 0) ip->d.nextents++;
+        } else {
+            dprintf("... inode %d has no extents left\n", ip->inode);
+            err = -1;
+        }
+        if (err < 0) {
+            bitmap_reset_run(&sector_bitmap, start, len);
+            return -1;
         }
+        dprintf("... allocated sectors %d-%d to inode %d\n", start, start + len - 1, ip->inode);
+        have += len;
+        ip->dirty = 1;
     }
-    return -1;
+    return 0;
 }
 
-// reset the i-th bit of a bitmap with 'num' sectors starting from
-// 'start' sector; return 0 if successful, -1 otherwise
-static int bitmap_reset(int start, int num, int ibit) {
-    char buffer[SECTOR_SIZE];
+// give back the data blocks of a file past the first 'nblocks' (and
+// the indirect blocks no longer needed); their content isn't cleared,
+// nor written or journaled any more, since every sector is written in
+// full when it's allocated again; inline content goes away only if none
+// is kept; return 0 if successful, -1 otherwise
+static int inode_shrink(minode_t *ip, int nblocks) {
+    if (ip->d.flags & INODE_INLINE) {
+        if (nblocks == 0) {
+            memset(ip->d.data, 0, INLINE_SIZE);
+            ip->d.flags &= ~INODE_INLINE;
+            ip->dirty = 1;
+        }
+        return 0;
+    }
+    if (inode_map(ip) < 0) return -1;
+    int n = ip->d.nextents;
+    while (n > 0 && ip->map[n - 1].first + ip->map[n - 1].len > nblocks) {
+        mextent_t *last = &ip->map[n - 1];
+        int keep = nblocks > last->first ? nblocks - last->first : 0;
+        cache_discard(last->start + keep, last->len - keep);
+        bitmap_reset_run(&sector_bitmap, last->start + keep, last->len - keep);
+        dprintf("... freed sectors %d-%d of inode %d\n",
+                last->start + keep, last->start + last->len - 1, ip->inode);
+        last->len = keep;
+        if (keep > 0) {
+            if (extent_store(ip, n - 1) < 0) return -1;
+            break;
+        }
+        if (n - 1 < DIRECT_EXTENTS) ip->d.ext[n - 1] = (extent_t) {0, 0};
+        n--;
+    }
+    ip->d.nextents = n;
+    ip->dirty = 1;
+
+    // the indirect blocks holding only extents past the last one
+    int keep = n - DIRECT_EXTENTS - (int) EXTENTS_PER_SECTOR; // extents left in the double-indirect part
+    if (ip->d.dindirect) {
+        int pointers[POINTERS_PER_SECTOR];
+        if (cache_read(ip->d.dindirect, (char *) pointers) < 0) return -1;
+        int first = keep > 0 ? (keep + (int) EXTENTS_PER_SECTOR - 1) / (int) EXTENTS_PER_SECTOR : 0;
+        for (int i = first; i < POINTERS_PER_SECTOR; i++) {
+            if (pointers[i]) {
+                cache_discard(pointers[i], 1);
+                bitmap_reset(&sector_bitmap, pointers[i]);
+                pointers[i] = 0;
+            }
+        }
+        if (first == 0) {
+            cache_discard(ip->d.dindirect, 1);
+            bitmap_reset(&sector_bitmap, ip->d.dindirect);
+            ip->d.dindirect = 0;
+        } else if (cache_write(ip->d.dindirect, (char *) pointers) < 0) {
+            return -1;
+        }
+    }
+    if (ip->d.indirect && n <= DIRECT_EXTENTS) {
+        cache_discard(ip->d.indirect, 1);
+        bitmap_reset(&sector_bitmap, ip->d.indirect);
+        ip->d.indirect = 0;
+    }
+    return 0;
+}
 
-    int sector = ibit / (SECTOR_SIZE * BYTE); // get sector
-    int byte = (ibit - (sector * (SECTOR_SIZE * BYTE))) / BYTE; // get byte/char position
-    int bit = ibit - (byte * BYTE) - (sector * (SECTOR_SIZE * BYTE)); // get bit specific position
+// give back all the data blocks of a file (and its indirect blocks)
+static void inode_truncate(minode_t *ip) {
+    inode_shrink(ip, 0);
+    free(ip->map);
+    ip->map = NULL;
+    ip->d.nextents = 0;
+    ip->d.indirect = ip->d.dindirect = 0;
+    ip->dirty = 1;
+}
 
-    // check if ibit is within boundaries
-    if (sector >= num) {
+// move the inline content of an inode to a data block of its own, the
+// first one, once it outgrows the inode; return 0 if successful (or if
+// the content isn't inline), -1 if the disk is full
+static int inode_uninline(minode_t *ip) {
+    if (!(ip->d.flags & INODE_INLINE)) return 0;
+    char buf[SECTOR_SIZE];
+    memset(buf, 0, SECTOR_SIZE);
+    memcpy(buf, ip->d.data, INLINE_SIZE);
+    memset(ip->d.data, 0, INLINE_SIZE);
+    ip->d.flags &= ~INODE_INLINE;
+    ip->dirty = 1;
+    if (inode_grow(ip, 1) < 0 || cache_write(inode_block(ip, 0, NULL), buf) < 0) {
+        inode_shrink(ip, 0);
+        memcpy(ip->d.data, buf, INLINE_SIZE);
+        ip->d.flags |= INODE_INLINE;
         return -1;
     }
+    dprintf("... moved inline content of inode %d to disk sector %d\n",
+            ip->inode, inode_block(ip, 0, NULL));
+    return 0;
+}
 
-    Disk_Read(start + sector, buffer);
-    // clear i-th bit
-    buffer[byte] &= ~(1 << (7 - bit));
-    // write changes to disk
-    return Disk_Write(start + sector, buffer);
+// number of directory entries a directory can keep inline
+#define INLINE_DIRENTS (INLINE_SIZE/sizeof(dirent_t))
+
+// copy 'n' entries of a directory, from the i-th on and all in the same
+// sector, out of the buffer cache (or out of the inode if inline);
+// return 0 if successful, -1 otherwise
+static int dirent_copy(minode_t *dp, int i, dirent_t *dirents, int n) {
+    if (dp->d.flags & INODE_INLINE) {
+        memcpy(dirents, dp->d.data + i * sizeof(dirent_t), n * sizeof(dirent_t));
+        return 0;
+    }
+    return cache_copy(inode_block(dp, i / DIRENTS_PER_SECTOR, NULL),
+                      (i % DIRENTS_PER_SECTOR) * sizeof(dirent_t), (char *) dirents, n * sizeof(dirent_t));
+}
+
+// overwrite entry 'i' of a directory; return 0 if successful, -1
+// otherwise
+static int dirent_patch(minode_t *dp, int i, dirent_t *dirent) {
+    if (dp->d.flags & INODE_INLINE) {
+        memcpy(dp->d.data + i * sizeof(dirent_t), dirent, sizeof(dirent_t));
+        dp->dirty = 1;
+        return 0;
+    }
+    return cache_patch(inode_block(dp, i / DIRENTS_PER_SECTOR, NULL),
+                       (i % DIRENTS_PER_SECTOR) * sizeof(dirent_t), (char *) dirent, sizeof(dirent_t));
+}
+
+// hash a file name for the directory index (FNV-1a)
+static unsigned dir_hash(char *fname) {
+    unsigned h = 2166136261u;
+    for (; *fname; fname++)
+        h = (h ^ (unsigned char) *fname) * 16777619u;
+    return h;
+}
+
+static void dir_index_link(dirindex_t *dx, int slot) {
+    int *head = &dx->buckets[dir_hash(dx->slots[slot].fname) & (dx->nbuckets - 1)];
+    dx->slots[slot].next = *head;
+    *head = slot;
+}
+
+static void dir_index_unlink(dirindex_t *dx, int slot) {
+    int *link = &dx->buckets[dir_hash(dx->slots[slot].fname) & (dx->nbuckets - 1)];
+    while (*link != slot)
+        link = &dx->slots[*link].next;
+    *link = dx->slots[slot].next;
+}
+
+// make room for 'n' entries in a directory index that has 'count' now,
+// rehashing them if there are fewer buckets than entries; return 0 if
+// successful, -1 if out of memory
+static int dir_index_reserve(dirindex_t *dx, int n, int count) {
+    if (n < 64) n = 64;
+    if (n > dx->nslots) {
+        int nslots = dx->nslots ? dx->nslots : 64;
+        while (nslots < n) nslots *= 2;
+        dirslot_t *slots = realloc(dx->slots, nslots * sizeof(dirslot_t));
+        if (!slots) return -1;
+        dx->slots = slots;
+        dx->nslots = nslots;
+    }
+    if (n > dx->nbuckets) {
+        int nbuckets = dx->nbuckets ? dx->nbuckets : 64;
+        while (nbuckets < n) nbuckets *= 2;
+        int *buckets = malloc(nbuckets * sizeof(int));
+        if (!buckets) return -1;
+        free(dx->buckets);
+        dx->buckets = buckets;
+        dx->nbuckets = nbuckets;
+        for (int i = 0; i < nbuckets; i++)
+            buckets[i] = -1;
+        for (int i = 0; i < count; i++)
+            dir_index_link(dx, i);
+    }
+    return 0;
+}
+
+// return the index of an in-core directory, building it from the
+// dirent sectors if it doesn't have one yet; return NULL on error
+static dirindex_t *dir_index(minode_t *dp) {
+    if (dp->dir) return dp->dir;
+    dirindex_t *dx = calloc(1, sizeof(dirindex_t));
+    if (!dx || dir_index_reserve(dx, dp->d.size, 0) < 0) {
+        dir_index_free(dx);
+        return NULL;
+    }
+    dirent_t dirents[DIRENTS_PER_SECTOR];
+    for (int i = 0; i < dp->d.size; i++) {
+        int n = dp->d.size - i < DIRENTS_PER_SECTOR ? dp->d.size - i : DIRENTS_PER_SECTOR;
+        if (i % DIRENTS_PER_SECTOR == 0 && dirent_copy(dp, i, dirents, n) < 0) {
+            dir_index_free(dx);
+            return NULL;
+        }
+        dirent_t *dirent = &dirents[i % DIRENTS_PER_SECTOR];
+        memcpy(dx->slots[i].fname, dirent->fname, MAX_NAME);
+        dx->slots[i].fname[MAX_NAME - 1] = '\0';
+        dx->slots[i].inode = dirent->inode;
+        dir_index_link(dx, i);
+    }
+    dprintf("... built index of directory inode %d (%d entries)\n", dp->inode, dp->d.size);
+    dp->dir = dx;
+    return dx;
+}
+
+// return the slot of the entry with the given name, or -1 if not found
+static int dir_index_find(dirindex_t *dx, char *fname) {
+    for (int i = dx->buckets[dir_hash(fname) & (dx->nbuckets - 1)]; i >= 0; i = dx->slots[i].next) {
+        if (!strcmp(dx->slots[i].fname, fname))
+            return i;
+    }
+    return -1;
+}
+
+// record a new entry appended as 'slot' to a directory; return 0 if
+// successful, -1 if out of memory
+static int dir_index_add(dirindex_t *dx, int slot, char *fname, int inode) {
+    if (dir_index_reserve(dx, slot + 1, slot) < 0) return -1;
+    strncpy(dx->slots[slot].fname, fname, MAX_NAME);
+    dx->slots[slot].fname[MAX_NAME - 1] = '\0';
+    dx->slots[slot].inode = inode;
+    dir_index_link(dx, slot);
+    return 0;
 }
 
 // return 1 if the file name is illegal; otherwise, return 0; legal
@@ -225,51 +1559,174 @@ static int illegal_filename(char *name) {
 }
 
 // return the child inode of the given file name 'fname' from the
-// parent inode; the parent inode is currently stored in the segment
-// of inode table in the cache (we cache only one disk sector for
-// this); once found, both cached_inode_sector and cached_inode_buffer
-// may be updated to point to the segment of inode table containing
-// the child inode; the function returns -1 if no such file is found;
+// parent inode; the function returns -1 if no such file is found;
 // it returns -2 is something else is wrong (such as parent is not
 // directory, or there's read error, etc.)
-static int find_child_inode(int parent_inode, char *fname,
-                            int *cached_inode_sector, char *cached_inode_buffer) {
-    int cached_start_entry = ((*cached_inode_sector) - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    int offset = parent_inode - cached_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t *parent = (inode_t *) (cached_inode_buffer + offset * sizeof(inode_t));
+static int find_child_inode(int parent_inode, char *fname) {
+    minode_t *parent = iget(parent_inode);
+    if (!parent) return -2;
+    pthread_rwlock_rdlock(&parent->lock);
     dprintf("... load parent inode: %d (size=%d, type=%d)\n",
-            parent_inode, parent->size, parent->type);
-    if (parent->type != 1) {
+            parent_inode, parent->d.size, parent->d.type);
+    if (parent->d.type != 1) {
         dprintf("... parent not a directory\n");
+        pthread_rwlock_unlock(&parent->lock);
+        iput(parent);
         return -2;
     }
 
-    int nentries = parent->size; // remaining number of directory entries
-    int idx = 0;
-    while (nentries > 0) {
-        char buf[SECTOR_SIZE]; // cached content of directory entries
-        if (Disk_Read(parent->data[idx], buf) < 0) return -2;
-        for (int i = 0; i < DIRENTS_PER_SECTOR; i++) {
-            if (i > nentries) break;
-            if (!strcmp(((dirent_t *) buf)[i].fname, fname)) {
-                // found the file/directory; update inode cache
-                int child_inode = ((dirent_t *) buf)[i].inode;
-                dprintf("... found child_inode=%d\n", child_inode);
-                int sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
-                if (sector != (*cached_inode_sector)) {
-                    *cached_inode_sector = sector;
-                    if (Disk_Read(sector, cached_inode_buffer) < 0) return -2;
-                    dprintf("... load inode table for child\n");
-                }
-                return child_inode;
-            }
+    if (!parent->dir) {
+        // building the index changes the inode
+        pthread_rwlock_unlock(&parent->lock);
+        pthread_rwlock_wrlock(&parent->lock);
+    }
+    dirindex_t *dx = dir_index(parent);
+    int slot = dx ? dir_index_find(dx, fname) : -1;
+    int child_inode = slot >= 0 ? dx->slots[slot].inode : dx ? -1 : -2;
+    pthread_rwlock_unlock(&parent->lock);
+    iput(parent);
+    if (child_inode >= 0) dprintf("... found child_inode=%d\n", child_inode);
+    else dprintf("... could not find child inode\n");
+    return child_inode;
+}
+
+// the dentry cache remembers what follow_path() found for the paths
+// (and their leading parts) it has resolved: the parent inode, the
+// inode of the last file/directory and its name; an inode of -1 is a
+// negative entry, recording that the parent has no such child; paths
+// are cached in normalized form, without repeated or trailing slashes;
+// entries are dropped when the files they name are created or removed,
+// and replaced following the CLOCK algorithm like the buffer cache;
+// 'dcache_lock' protects it as lookups may run in several threads
+#define DCACHE_ENTRIES 1024
+#define DCACHE_BUCKETS 2048
+
+typedef struct _dentry {
+    char path[MAX_PATH];  // the normalized path ("" if the entry is free)
+    char fname[MAX_NAME]; // the last file/directory name of the path
+    int parent;           // inode of the parent directory
+    int inode;            // inode of the file/directory, -1 if it doesn't exist
+    int used;             // reference bit for CLOCK
+    int next;             // next entry in the same hash bucket (-1 ends the chain)
+} dentry_t;
+
+static dentry_t dcache[DCACHE_ENTRIES];
+static int dcache_buckets[DCACHE_BUCKETS];
+static int dcache_hand;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// drop all cached paths
+static void dcache_reset() {
+    pthread_mutex_lock(&dcache_lock);
+    for (int i = 0; i < DCACHE_ENTRIES; i++) {
+        dcache[i].path[0] = '\0';
+        dcache[i].used = 0;
+        dcache[i].next = -1;
+    }
+    for (int i = 0; i < DCACHE_BUCKETS; i++)
+        dcache_buckets[i] = -1;
+    dcache_hand = 0;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// copy an absolute path into 'out' (MAX_PATH bytes) without repeated
+// or trailing slashes; a path that's too long is truncated
+static void normalize_path(char *path, char *out) {
+    int n = 0;
+    for (; *path && n < MAX_PATH - 1; path++) {
+        if (*path == '/' && n > 0 && out[n - 1] == '/') continue;
+        out[n++] = *path;
+    }
+    if (n > 1 && out[n - 1] == '/') n--;
+    out[n] = '\0';
+}
+
+// return the entry of a (normalized) path, or -1 if it's not cached;
+// the caller must hold 'dcache_lock'
+static int dcache_find(char *path) {
+    for (int i = dcache_buckets[dir_hash(path) % DCACHE_BUCKETS]; i >= 0; i = dcache[i].next) {
+        if (!strcmp(dcache[i].path, path))
+            return i;
+    }
+    return -1;
+}
+
+// look up a (normalized) path; if it's cached, return 1 with what was
+// found for it copied to 'parent', 'inode' and 'fname' (unless NULL);
+// otherwise, return 0
+static int dcache_lookup(char *path, int *parent, int *inode, char *fname) {
+    pthread_mutex_lock(&dcache_lock);
+    int i = dcache_find(path);
+    if (i >= 0) {
+        dcache[i].used = 1;
+        if (parent) *parent = dcache[i].parent;
+        *inode = dcache[i].inode;
+        if (fname) strcpy(fname, dcache[i].fname);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return i >= 0;
+}
+
+static void dcache_unhash(int i) {
+    int *link = &dcache_buckets[dir_hash(dcache[i].path) % DCACHE_BUCKETS];
+    while (*link != i)
+        link = &dcache[*link].next;
+    *link = dcache[i].next;
+    dcache[i].path[0] = '\0';
+}
+
+// remember a resolved (normalized) path; several threads may resolve
+// the same one at once, and the later ones update its entry in place,
+// as dcache_forget() removes a single entry per path
+static void dcache_enter(char *path, int parent, int inode, char *fname) {
+    pthread_mutex_lock(&dcache_lock);
+    int i = dcache_find(path);
+    if (i >= 0) {
+        dcache[i].parent = parent;
+        dcache[i].inode = inode;
+        dcache[i].used = 1;
+        pthread_mutex_unlock(&dcache_lock);
+        return;
+    }
+    for (;;) {
+        i = dcache_hand;
+        dcache_hand = (dcache_hand + 1) % DCACHE_ENTRIES;
+        if (dcache[i].path[0] && dcache[i].used) {
+            // give it a second chance
+            dcache[i].used = 0;
+            continue;
+        }
+        break;
+    }
+    if (dcache[i].path[0]) dcache_unhash(i);
+    strcpy(dcache[i].path, path);
+    strcpy(dcache[i].fname, fname);
+    dcache[i].parent = parent;
+    dcache[i].inode = inode;
+    dcache[i].used = 1;
+    dcache[i].next = dcache_buckets[dir_hash(path) % DCACHE_BUCKETS];
+    dcache_buckets[dir_hash(path) % DCACHE_BUCKETS] = i;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// forget a path once the file/directory it names has been created or
+// removed; with 'subtree' set, all paths below it are forgotten too
+static void dcache_forget(char *path, int subtree) {
+    char key[MAX_PATH];
+    normalize_path(path, key);
+    pthread_mutex_lock(&dcache_lock);
+    if (!subtree) {
+        int i = dcache_find(key);
+        if (i >= 0) dcache_unhash(i);
+    } else {
+        size_t len = strlen(key);
+        for (int i = 0; i < DCACHE_ENTRIES; i++) {
+            if (dcache[i].path[0] && !strncmp(dcache[i].path, key, len) &&
+                (dcache[i].path[len] == '\0' || dcache[i].path[len] == '/'))
+                dcache_unhash(i);
         }
-        idx++;
-        nentries -= DIRENTS_PER_SECTOR;
     }
-    dprintf("... could not find child inode\n");
-    return -1; // not found
+    pthread_mutex_unlock(&dcache_lock);
 }
 
 // follow the absolute path; if successful, return the inode of the
@@ -291,25 +1748,26 @@ static int follow_path(char *path, int *last_inode, char *last_fname) {
         return -1;
     }
 
-    // make a copy of the path (skip leading '/'); this is necessary
-    // since the path is going to be modified by strsep()
-    char pathstore[MAX_PATH];
-    strncpy(pathstore, path + 1, MAX_PATH - 1);
-    pathstore[MAX_PATH - 1] = '\0'; // for safety
-    char *lpath = pathstore;
-
+    // the whole path may have been resolved before
+    char key[MAX_PATH];
+    normalize_path(path, key);
     int parent_inode = -1, child_inode = 0; // start from root
-    // cache the disk sector containing the root inode
-    int cached_sector = INODE_TABLE_START_SECTOR;
-    char cached_buffer[SECTOR_SIZE];
-    if (Disk_Read(cached_sector, cached_buffer) < 0) return -1;
-    dprintf("... load inode table for root from disk sector %d\n", cached_sector);
-
-    // for each file/directory name separated by '/'
-    char *token;
-    while ((token = strsep(&lpath, "/")) != NULL) {
+    if (dcache_lookup(key, &parent_inode, last_inode, last_fname)) {
+        dprintf("... dentry cache hit: parent_inode=%d, child_inode=%d\n", parent_inode, *last_inode);
+        return parent_inode;
+    }
+
+
+    // for each file/directory name separated by '/'; while a name is
+    // processed, 'key' is cut right after it so that it holds the path
+    // leading to the name
+    char *token = key + 1;
+    while (*token) {
+        char *end = strchr(token, '/');
+        if (!end) end = token + strlen(token);
+        char save = *end;
+        *end = '\0';
         dprintf("... process token: '%s'\n", token);
-        if (*token == '\0') continue; // multiple '/' ignored
         if (illegal_filename(token)) {
             dprintf("... illegal file name: '%s'\n", token);
             return -1;
@@ -322,9 +1780,13 @@ static int follow_path(char *path, int *last_inode, char *last_fname) {
             return -1;
         }
         parent_inode = child_inode;
-        child_inode = find_child_inode(parent_inode, token,
-                                       &cached_sector, cached_buffer);
+        if (!dcache_lookup(key, NULL, &child_inode, NULL)) {
+            child_inode = find_child_inode(parent_inode, token);
+            if (child_inode >= -1) dcache_enter(key, parent_inode, child_inode, token);
+        }
         if (last_fname) strcpy(last_fname, token);
+        *end = save;
+        token = save ? end + 1 : end;
     }
     if (child_inode < -1) return -1; // if there was error, abort
     else {
@@ -340,239 +1802,774 @@ static int follow_path(char *path, int *last_inode, char *last_fname) {
     }
 }
 
+// append 'n' entries to a directory, writing each dirent sector they
+// go to once (a new one whenever the last is full), or keeping them
+// inline while they fit; the caller holds the directory's lock and
+// updates its index; return 0 if successful, -1 if the disk is full
+static int dirent_append(minode_t *dp, dirent_t *dirents, int n) {
+    int size = dp->d.size;
+    if (size + n <= INLINE_DIRENTS && (dp->d.flags & INODE_INLINE || !inode_nblocks(dp))) {
+        dp->d.flags |= INODE_INLINE;
+        memcpy(dp->d.data + size * sizeof(dirent_t), dirents, n * sizeof(dirent_t));
+        dprintf("... append dirents %d-%d inline\n", size, size + n - 1);
+    } else {
+        int nblocks = (size + n + DIRENTS_PER_SECTOR - 1) / DIRENTS_PER_SECTOR;
+        if (nblocks > MAX_SECTORS_PER_FILE || inode_uninline(dp) < 0 || inode_grow(dp, nblocks) < 0) {
+            inode_shrink(dp, (size + DIRENTS_PER_SECTOR - 1) / DIRENTS_PER_SECTOR);
+            return -1;
+        }
+        for (int i = 0; i < n;) {
+            int slot = size + i;
+            int k = DIRENTS_PER_SECTOR - slot % DIRENTS_PER_SECTOR;
+            if (k > n - i) k = n - i;
+            char buf[SECTOR_SIZE];
+            int sector = inode_block(dp, slot / DIRENTS_PER_SECTOR, NULL);
+            if (slot % DIRENTS_PER_SECTOR == 0) memset(buf, 0, SECTOR_SIZE);
+            else if (cache_read(sector, buf) < 0) return -1;
+            memcpy(buf + (slot % DIRENTS_PER_SECTOR) * sizeof(dirent_t), dirents + i, k * sizeof(dirent_t));
+            if (cache_write(sector, buf) < 0) return -1;
+            dprintf("... append dirents %d-%d to disk sector %d\n", slot, slot + k - 1, sector);
+            i += k;
+        }
+    }
+    dp->d.size += n;
+    dp->dirty = 1;
+    return 0;
+}
+
 // add a new file or directory (determined by 'type') of given name
 // 'file' under parent directory represented by 'parent_inode'
 int add_inode(int type, int parent_inode, char *file) {
     // get a new inode for child
-    int child_inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE);
+    int child_inode = bitmap_first_unused(&inode_bitmap);
     if (child_inode < 0) {
         dprintf("... error: inode table is full\n");
         return -1;
     }
     dprintf("... new child inode %d\n", child_inode);
 
-    // load the disk sector containing the child inode
-    int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if (Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-    dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
-
-    // get the child inode
-    int inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    int offset = child_inode - inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t *child = (inode_t *) (inode_buffer + offset * sizeof(inode_t));
-
-    // update the new child inode and write to disk
-    memset(child, 0, sizeof(inode_t));
-    child->type = type;
-    if (Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-    dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
-            child_inode, child->size, child->type, inode_sector);
-
-    // get the disk sector containing the parent inode
-    inode_sector = INODE_TABLE_START_SECTOR + parent_inode / INODES_PER_SECTOR;
-    if (Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-    dprintf("... load inode table for parent inode %d from disk sector %d\n",
-            parent_inode, inode_sector);
-
-    // get the parent inode
-    inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    offset = parent_inode - inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t *parent = (inode_t *) (inode_buffer + offset * sizeof(inode_t));
+    // initialize the new child inode
+    minode_t *child = iget(child_inode);
+    if (!child) {
+        bitmap_reset(&inode_bitmap, child_inode);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&child->lock);
+    memset(&child->d, 0, sizeof(inode_t));
+    child->d.type = type;
+    child->dirty = 1;
+    dprintf("... update child inode %d (size=%d, type=%d)\n",
+            child_inode, child->d.size, child->d.type);
+    pthread_rwlock_unlock(&child->lock);
+    iput(child);
+
+    // get the parent inode; on failure, the child inode is given back
+    minode_t *ip = iget(parent_inode);
+    if (!ip) {
+        bitmap_reset(&inode_bitmap, child_inode);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&ip->lock);
+    inode_t *parent = &ip->d;
     dprintf("... get parent inode %d (size=%d, type=%d)\n",
             parent_inode, parent->size, parent->type);
 
-    // get the dirent sector
     if (parent->type != 1) {
         dprintf("... error: parent inode is not directory\n");
+        pthread_rwlock_unlock(&ip->lock);
+        iput(ip);
+        bitmap_reset(&inode_bitmap, child_inode);
         return -2; // parent not directory
     }
-    int group = parent->size / DIRENTS_PER_SECTOR;
-    char dirent_buffer[SECTOR_SIZE];
-    if (group * DIRENTS_PER_SECTOR == parent->size) {
-        // new disk sector is needed
-        int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-        if (newsec < 0) {
-            dprintf("... error: disk is full\n");
-            return -1;
-        }
-        parent->data[group] = newsec;
-        memset(dirent_buffer, 0, SECTOR_SIZE);
-        dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
-    } else {
-        if (Disk_Read(parent->data[group], dirent_buffer) < 0)
-            return -1;
-        dprintf("... load disk sector %d for dirent group %d\n", parent->data[group], group);
-    }
-
-    // add the dirent and write to disk
-    int start_entry = group * DIRENTS_PER_SECTOR;
-    offset = parent->size - start_entry;
-    dirent_t *dirent = (dirent_t *) (dirent_buffer + offset * sizeof(dirent_t));
-    strncpy(dirent->fname, file, MAX_NAME);
-    dirent->inode = child_inode;
-    if (Disk_Write(parent->data[group], dirent_buffer) < 0) return -1;
-    dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
-            parent->size, dirent->fname, dirent->inode, group, parent->data[group]);
-
-    // update parent inode and write to disk
-    parent->size++;
-    if (Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-    dprintf("... update parent inode on disk sector %d\n", inode_sector);
 
+    // add the dirent
+    dirent_t dirent;
+    memset(&dirent, 0, sizeof(dirent_t));
+    strncpy(dirent.fname, file, MAX_NAME);
+    dirent.inode = child_inode;
+    if (dirent_append(ip, &dirent, 1) < 0) {
+        dprintf("... error: disk is full\n");
+        pthread_rwlock_unlock(&ip->lock);
+        iput(ip);
+        bitmap_reset(&inode_bitmap, child_inode);
+        return -1;
+    }
+    if (ip->dir && dir_index_add(ip->dir, parent->size - 1, file, child_inode) < 0) {
+        // rebuild it when it's needed next
+        dir_index_free(ip->dir);
+        ip->dir = NULL;
+    }
+    pthread_rwlock_unlock(&ip->lock);
+    iput(ip);
     return 0;
 }
 
+static void journal_note(); // see the journal below
+
 // used by both File_Create() and Dir_Create(); type=0 is file, type=1
 // is directory
 int create_file_or_directory(int type, char *pathname) {
-    int child_inode;
+    int child_inode, ret = -1;
     char last_fname[MAX_NAME];
+    pthread_rwlock_wrlock(&ns_lock);
     int parent_inode = follow_path(pathname, &child_inode, last_fname);
     if (parent_inode >= 0) {
         if (child_inode >= 0) {
             dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
             osErrno = E_CREATE;
-            return -1;
         } else {
             if (add_inode(type, parent_inode, last_fname) >= 0) {
+                dcache_forget(pathname, 0);
                 dprintf("... successfully created file/directory: '%s'\n", pathname);
-                return 0;
+                ret = 0;
             } else {
                 dprintf("... error: something wrong with adding child inode\n");
                 osErrno = E_CREATE;
-                return -1;
             }
         }
     } else {
         dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
         osErrno = E_CREATE;
-        return -1;
     }
+    pthread_rwlock_unlock(&ns_lock);
+    if (!ret) journal_note();
+    return ret;
 }
 
-// remove the child from parent; the function is called by both
-// File_Unlink() and Dir_Unlink(); the function returns 0 if success,
-// -1 if general error, -2 if directory not empty, -3 if wrong type
-int remove_inode(int type, int parent_inode, int child_inode) {
-    // TODO remove_inode
-    // load the disk sector containing the child inode
-    int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if (Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-    dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
+// move dirent 'from' of a directory into the place of dirent 'to', on
+// disk and in the directory index; return 0 if successful, -1 otherwise
+static int dir_move(minode_t *dp, dirindex_t *dx, int from, int to) {
+    dirent_t moved;
+    if (dirent_copy(dp, from, &moved, 1) < 0 || dirent_patch(dp, to, &moved) < 0)
+        return -1;
+    dir_index_unlink(dx, from);
+    dx->slots[to] = dx->slots[from];
+    dir_index_link(dx, to);
+    dprintf("... moved dirent %d (name='%s') to %d\n", from, moved.fname, to);
+    return 0;
+}
 
-    // get the child inode
-    int inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    int offset = child_inode - inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t *child = (inode_t *) (inode_buffer + offset * sizeof(inode_t));
+// free a file or directory (determined by 'type') once its entry is
+// gone, with all its data; return 0 if successful, -1 if general
+// error, -2 if directory not empty, -3 if wrong type
+static int inode_release(int type, int child_inode) {
+    minode_t *ip = iget(child_inode);
+    if (!ip) return -1;
+    pthread_rwlock_wrlock(&ip->lock);
+    inode_t *child = &ip->d;
 
     //check type and check for empty directory
     if (child->type != type) {
+        pthread_rwlock_unlock(&ip->lock);
+        iput(ip);
         return -3;
-    } else if (child->type && child->size) { return -2; }
+    } else if (child->type && child->size) {
+        pthread_rwlock_unlock(&ip->lock);
+        iput(ip);
+        return -2;
+    }
+
+    // streams still open on a removed directory are at its end for good
+    for (open_file_t *st = ip->streams; st; st = st->snext)
+        st->inode = -1;
+
+    // remove all data related to the file
+    inode_truncate(ip);
+    dir_index_free(ip->dir);
+    ip->dir = NULL;
+    //remove the child inode
+    memset(child, 0, sizeof(inode_t));
+    ip->dirty = 1;
+    dprintf("... update child inode %d (size=%d, type=%d)\n",
+            child_inode, child->size, child->type);
+    pthread_rwlock_unlock(&ip->lock);
+    iput(ip);
+    bitmap_reset(&inode_bitmap, child_inode);
+    return 0;
+}
+
+// remove entry 'slot' of a directory, moving the last entry into its
+// place so that the entries stay packed; the caller holds the lock of
+// the directory, whose index is 'dx'; return 0 if successful, -1
+// otherwise
+static int dirent_remove(minode_t *ip, dirindex_t *dx, int slot) {
+    // with directory streams open, the hole first travels to each cursor
+    // past it: the entry right before the cursor (already returned by
+    // the stream) fills the hole, and the cursor steps back over the new
+    // one; so no stream misses or repeats an entry that stays
+    int last = ip->d.size - 1;
+    int hole = slot;
+    dir_index_unlink(dx, slot);
+    for (;;) {
+        int cursor = -1; // the nearest cursor past the hole
+        for (open_file_t *st = ip->streams; st; st = st->snext) {
+            if (st->pos > hole && (cursor < 0 || st->pos < cursor))
+                cursor = st->pos;
+        }
+        if (cursor < 0) break;
+        if (cursor - 1 != hole && dir_move(ip, dx, cursor - 1, hole) < 0) return -1;
+        hole = cursor - 1;
+        for (open_file_t *st = ip->streams; st; st = st->snext) {
+            if (st->pos == cursor) st->pos--;
+        }
+    }
+    dirent_t empty;
+    memset(&empty, 0, sizeof(dirent_t));
+    if ((hole != last && dir_move(ip, dx, last, hole) < 0) || dirent_patch(ip, last, &empty) < 0)
+        return -1;
+    ip->d.size--;
+    ip->dirty = 1;
+    if (ip->d.size % DIRENTS_PER_SECTOR == 0) {
+        // the last dirent sector is empty now
+        inode_shrink(ip, ip->d.size / DIRENTS_PER_SECTOR);
+    }
+    return 0;
+}
+
+// remove the child (named 'fname') from parent; the function is called
+// by both File_Unlink() and Dir_Unlink(); the function returns 0 if
+// success, -1 if general error, -2 if directory not empty, -3 if wrong
+// type
+int remove_inode(int type, int parent_inode, int child_inode, char *fname) {
+    int err = inode_release(type, child_inode);
+    if (err < 0) return err;
+
+    // get the parent inode
+    minode_t *ip = iget(parent_inode);
+    if (!ip) return -1;
+    pthread_rwlock_wrlock(&ip->lock);
+    dprintf("... get parent inode %d (size=%d, type=%d)\n",
+            parent_inode, ip->d.size, ip->d.type);
+
+    if (ip->d.type != 1) {
+        dprintf("... error: parent inode is not directory\n");
+        pthread_rwlock_unlock(&ip->lock);
+        iput(ip);
+        return -2; // parent not directory
+    }
+
+    // find the child's dirent and take it out
+    dirindex_t *dx = dir_index(ip);
+    int slot = dx ? dir_index_find(dx, fname) : -1;
+    if (slot < 0 || dx->slots[slot].inode != child_inode) {
+        dprintf("... no dirent '%s' for inode %d\n", fname, child_inode);
+        pthread_rwlock_unlock(&ip->lock);
+        iput(ip);
+        return -1;
+    }
+    err = dirent_remove(ip, dx, slot);
+    pthread_rwlock_unlock(&ip->lock);
+    iput(ip);
+    return err;
+}
+
+// the open file table is allocated in chunks of FD_CHUNK entries as
+// more files are open at once, so that entries never move; closed
+// descriptors are kept on a stack and handed out again first
+#define FD_CHUNK 256
+
+static open_file_t *open_files[(MAX_OPEN_FILES + FD_CHUNK - 1) / FD_CHUNK];
+static int fd_top;   // number of descriptors handed out so far
+static int *fd_free; // stack of closed descriptors, room for all chunks
+static int fd_nfree; // number of descriptors on the stack
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER; // for the table and positions
+
+#define OPEN_FILE(fd) (&open_files[(fd) / FD_CHUNK][(fd) % FD_CHUNK])
+
+// close all file descriptors (used when the disk is reloaded)
+static void fd_reset() {
+    for (int i = 0; i * FD_CHUNK < fd_top; i++)
+        memset(open_files[i], 0, FD_CHUNK * sizeof(open_file_t));
+    fd_top = 0;
+    fd_nfree = 0;
+}
+
+// return true if the file pointed to by inode has already been open
+int is_file_open(int inode) {
+    return inode >= 0 && iopens(inode) > 0;
+}
+
+// return a new file descriptor not used; -1 if full; the caller must
+// hold 'fd_lock'
+int new_file_fd() {
+    if (fd_nfree > 0) return fd_free[--fd_nfree];
+    if (fd_top >= MAX_OPEN_FILES) return -1;
+    if (!open_files[fd_top / FD_CHUNK]) {
+        // a new chunk, and room on the stack for its descriptors
+        int *stack = realloc(fd_free, (fd_top + FD_CHUNK) * sizeof(int));
+        if (!stack) return -1;
+        fd_free = stack;
+        if (!(open_files[fd_top / FD_CHUNK] = calloc(FD_CHUNK, sizeof(open_file_t))))
+            return -1;
+    }
+    return fd_top++;
+}
+
+// put a file descriptor back once closed; the caller must hold 'fd_lock'
+static void free_file_fd(int fd) {
+    memset(OPEN_FILE(fd), 0, sizeof(open_file_t));
+    fd_free[fd_nfree++] = fd;
+}
+
+// write 'size' bytes to a file at position 'pos', allocating sectors
+// as needed, and return the number of bytes written; return -1 (with
+// osErrno set) on error
+static int file_write_at(minode_t *ip, int pos, char *buffer, int size) {
+    inode_t *inode = &ip->d;
+
+    // a small file is kept inline for as long as it fits
+    if (pos + size <= INLINE_SIZE && (inode->flags & INODE_INLINE || !inode_nblocks(ip))) {
+        memcpy(inode->data + pos, buffer, (size_t) size);
+        inode->flags |= INODE_INLINE;
+        if (pos + size > inode->size) inode->size = pos + size;
+        ip->dirty = 1;
+        dprintf("... wrote %d bytes inline\n", size);
+        return size;
+    }
+    if (inode_uninline(ip) < 0) {
+        dprintf("... no space left\n");
+        osErrno = E_NO_SPACE;
+        return -1;
+    }
+
+    // allocate all the sectors the write needs at once, so that they
+    // are placed together (and after the ones the file already has)
+    int allocated = inode_nblocks(ip);
+    if (inode_grow(ip, (pos + size + SECTOR_SIZE - 1) / SECTOR_SIZE) < 0) {
+        dprintf("... no space left\n");
+        osErrno = E_NO_SPACE;
+        return -1;
+    }
+
+    int bytesWritten = 0;
+    while (bytesWritten < size) {
+        int sector = pos / SECTOR_SIZE;
+        int offset = pos % SECTOR_SIZE;
+        int n = SECTOR_SIZE - offset;
+        if (n > size - bytesWritten) n = size - bytesWritten;
+
+        char sectorBuffer[SECTOR_SIZE];
+        int disk_sector = inode_block(ip, sector, NULL);
+        if (sector >= allocated) {
+            // a new sector, nothing to preserve
+            memset(sectorBuffer, 0, SECTOR_SIZE);
+        } else if (n < SECTOR_SIZE && cache_read(disk_sector, sectorBuffer) < 0) {
+            // the rest of the sector must be preserved
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        memcpy(sectorBuffer + offset, buffer + bytesWritten, (size_t) n);
+        if (cache_write(disk_sector, sectorBuffer) < 0) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        dprintf("... wrote %d bytes to disk sector %d\n", n, disk_sector);
+        bytesWritten += n;
+        pos += n;
+        if (pos > inode->size) {
+            inode->size = pos;
+            ip->dirty = 1;
+        }
+    }
+    return bytesWritten;
+}
+
+// return the number of index sectors (indirect and double-indirect
+// blocks) a file with 'nextents' extents uses
+static int extent_index_sectors(int nextents) {
+    if (nextents <= DIRECT_EXTENTS) return 0;
+    nextents -= DIRECT_EXTENTS;
+    if (nextents <= (int) EXTENTS_PER_SECTOR) return 1;
+    nextents -= (int) EXTENTS_PER_SECTOR;
+    return 2 + (nextents + (int) EXTENTS_PER_SECTOR - 1) / (int) EXTENTS_PER_SECTOR;
+}
+
+// reserve in the sector bitmap the sectors the write buffer of a file
+// needs for its data to end at 'end' when it's flushed, counting the
+// index sectors it could take if each new sector were an extent of its
+// own, so that a buffered write is only acknowledged if there's room
+// for it; no other allocation may take reserved sectors; return 0 if
+// successful, -1 if there isn't enough free space
+static int wbuf_reserve(minode_t *ip, int end) {
+    int need = 0;
+    if (end > INLINE_SIZE || (!(ip->d.flags & INODE_INLINE) && inode_nblocks(ip))) {
+        need = (end + SECTOR_SIZE - 1) / SECTOR_SIZE - inode_nblocks(ip);
+        if (need < 0) need = 0;
+        need += extent_index_sectors(ip->d.nextents + need) -
+                extent_index_sectors(ip->d.nextents);
+    }
+    pthread_mutex_lock(&sector_bitmap.lock);
+    int ok = need <= ip->wres || need - ip->wres <= bitmap_avail(&sector_bitmap);
+    if (ok) {
+        sector_bitmap.reserved += need - ip->wres;
+        ip->wres = need;
+    }
+    pthread_mutex_unlock(&sector_bitmap.lock);
+    return ok ? 0 : -1;
+}
+
+// place the data held in the write buffer of a file on disk, drawing
+// on the sectors reserved for it, and give back what's left of the
+// reservation; return 0 if successful, -1 (with osErrno set) otherwise,
+// in which case the data is lost and the file is cut back to the
+// sectors it has (which the reservation should prevent)
+static int file_flush(minode_t *ip) {
+    if (!ip->wlen) return 0;
+    int wlen = ip->wlen;
+    ip->wlen = 0;
+    dprintf("... flush %d bytes at %d of inode %d\n", wlen, ip->wpos, ip->inode);
+    bitmap_mine = ip->wres;
+    int err = file_write_at(ip, ip->wpos, ip->wbuf, wlen);
+    pthread_mutex_lock(&sector_bitmap.lock);
+    sector_bitmap.reserved -= bitmap_mine;
+    bitmap_mine = 0;
+    ip->wres = 0;
+    pthread_mutex_unlock(&sector_bitmap.lock);
+    if (err < 0) {
+        int limit = ip->d.flags & INODE_INLINE ? INLINE_SIZE : inode_nblocks(ip) * SECTOR_SIZE;
+        if (ip->d.size > limit) {
+            ip->d.size = limit;
+            ip->dirty = 1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// write the buffered data and the modified inodes back to the disk
+// (well, to the buffer cache)
+static int iflush() {
+    int n, err = 0;
+    minode_t **list = icache_all(&n);
+    if (n < 0) return -1;
+    for (int i = 0; i < n; i++) {
+        pthread_rwlock_wrlock(&list[i]->lock);
+        if (!err && (file_flush(list[i]) < 0 || (list[i]->dirty && iupdate(list[i]) < 0)))
+            err = -1;
+        pthread_rwlock_unlock(&list[i]->lock);
+        iput(list[i]);
+    }
+    free(list);
+    return err;
+}
+
+// write everything kept in memory (buffered writes, inodes, bitmaps,
+// cached sectors) to the disk
+static int fs_flush() {
+    if (iflush() < 0 || bitmap_sync(&inode_bitmap) < 0 ||
+        bitmap_sync(&sector_bitmap) < 0 || cache_flush() < 0)
+        return -1;
+    return 0;
+}
+
+// the journal makes the changes to the file system durable without
+// saving the whole disk image: a commit writes the contents of all the
+// sectors modified since the previous one, file data as well as
+// metadata, as a single record appended to a file next to the image
+// ('<image>.journal'), and FS_Boot()
+// replays the records the image doesn't include yet; FS_Sync() commits,
+// and so does every JOURNAL_BATCH-th change to the name space, so that
+// many operations are grouped in one record; threads asking for a
+// commit while one is being written wait for the next one, which
+// covers all of them (group commit); a record is only replayed if it's
+// complete and its checksum matches, so a crash while it's written
+// loses just that commit; once JOURNAL_MAX sectors have been logged, a
+// commit also starts a checkpoint: the image is saved in the background
+// from a snapshot of the disk, while new records go to a fresh journal
+// file; the previous one ('<image>.journal.old') is removed when the
+// save has completed; JOURNAL_MAX is sized for the number of sectors
+// a boot may have to replay, not for the capacity of the disk
+#define JOURNAL_MAGIC 0x4a524e4c
+#define JOURNAL_BATCH 64
+#define JOURNAL_MAX 1024
+
+// a record is this header, followed by the numbers of the sectors it
+// holds and then their contents
+typedef struct _jheader {
+    int magic;
+    int seq;      // sequence number of the commit
+    int count;    // number of sectors
+    uint32_t sum; // checksum of the sector numbers and contents
+} jheader_t;
+
+static FILE *journal_file;
+static int journal_seq;     // sequence number of the last commit
+static int journal_ops;     // changes to the name space since the last commit
+static int journal_logged;  // sectors logged since the last checkpoint
+static int journal_busy;    // 1 while a commit is being made
+static long journal_started, journal_finished; // commits made (for group commit)
+static int journal_result;  // the result of the last commit
+static int journal_saving;  // 1 while a checkpoint is being saved
+static Disk_Snapshot_t *journal_snap; // the image being saved
+static Disk_Request_t journal_save;   // the request saving it
+static char journal_image[1024];      // the file it's saved to
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER; // for group commit
+static pthread_cond_t journal_done = PTHREAD_COND_INITIALIZER;
+
+// the name of the journal file ('suffix' is "" or ".old")
+static void journal_name(char *name, char *suffix) {
+    sprintf(name, "%s.journal%s", bs_filename, suffix);
+}
+
+// checksum of a record (FNV-1a, continued from 'h')
+static uint32_t journal_sum(uint32_t h, void *buf, size_t len) {
+    for (unsigned char *p = buf; len > 0; p++, len--)
+        h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+// append a record to the journal file and make sure it's on disk;
+// return 0 if successful, -1 otherwise
+static int journal_append(int seq, int *sectors, char *data, int count) {
+    jheader_t h = {JOURNAL_MAGIC, seq, count, 0};
+    h.sum = journal_sum(journal_sum(2166136261u, sectors, count * sizeof(int)),
+                        data, (size_t) count * SECTOR_SIZE);
+    if (!journal_file) return -1;
+    long end = ftell(journal_file);
+    if (fwrite(&h, sizeof(h), 1, journal_file) != 1 ||
+        fwrite(sectors, sizeof(int), (size_t) count, journal_file) != count ||
+        fwrite(data, SECTOR_SIZE, (size_t) count, journal_file) != count ||
+        fflush(journal_file) != 0 || fsync(fileno(journal_file)) < 0) {
+        // don't leave a partial record for the next one to follow
+        if (end >= 0 && ftruncate(fileno(journal_file), end) == 0)
+            fseek(journal_file, end, SEEK_SET);
+        return -1;
+    }
+    dprintf("... journal: commit %d (%d sectors)\n", seq, count);
+    return 0;
+}
 
-    // remove all data related to the file
-    for (int i = 0; i < MAX_SECTORS_PER_FILE; ++i) {
-        if (child->data[i]) {
-            char clearingBuffer[SECTOR_SIZE];
-            Disk_Read(child->data[i], clearingBuffer);
-            memset(clearingBuffer, 0, SECTOR_SIZE);
-            Disk_Write(child->data[i], clearingBuffer);
-            bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, child->data[i]);
+// apply the records of a journal file that follow commit 'seq' to the
+// disk, stopping at the first one that's incomplete or damaged, whose
+// offset is returned through 'end'; return the sequence number of the
+// last commit applied
+static int journal_replay(char *name, int seq, long *end) {
+    FILE *f = fopen(name, "rb");
+    *end = 0;
+    if (!f) return seq;
+    jheader_t h;
+    while (fread(&h, sizeof(h), 1, f) == 1 && h.magic == JOURNAL_MAGIC &&
+           h.count > 0 && h.count <= TOTAL_SECTORS && h.seq <= seq + 1) {
+        int *sectors = malloc(h.count * sizeof(int));
+        char *data = malloc((size_t) h.count * SECTOR_SIZE);
+        int ok = sectors && data &&
+                 fread(sectors, sizeof(int), (size_t) h.count, f) == h.count &&
+                 fread(data, SECTOR_SIZE, (size_t) h.count, f) == h.count &&
+                 journal_sum(journal_sum(2166136261u, sectors, h.count * sizeof(int)),
+                             data, (size_t) h.count * SECTOR_SIZE) == h.sum;
+        for (int i = 0; ok && h.seq == seq + 1 && i < h.count; i++) {
+            if (Disk_Write(sectors[i], data + i * SECTOR_SIZE) < 0)
+                ok = 0;
         }
+        free(sectors);
+        free(data);
+        if (!ok) break;
+        if (h.seq == seq + 1) {
+            dprintf("... journal: replayed commit %d (%d sectors)\n", h.seq, h.count);
+            seq = h.seq;
+        }
+        *end = ftell(f);
     }
-    //remove the child inode
-    memset(child, 0, sizeof(inode_t));
-    if (Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-    dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
-            child_inode, child->size, child->type, inode_sector);
-    bitmap_reset(INODE_TABLE_START_SECTOR, INODE_BITMAP_SECTORS, child_inode);
-
+    fclose(f);
+    return seq;
+}
 
-    // get the disk sector containing the parent inode
-    inode_sector = INODE_TABLE_START_SECTOR + parent_inode / INODES_PER_SECTOR;
-    if (Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-    dprintf("... load inode table for parent inode %d from disk sector %d\n",
-            parent_inode, inode_sector);
+// finish a checkpoint once its image has been saved
+static void journal_reap() {
+    if (!journal_snap || cache_poll(&journal_saving) > 0) return;
+    Disk_SnapshotRelease(journal_snap);
+    journal_snap = NULL;
+    if (journal_save.result == 0) {
+        char name[1040];
+        journal_name(name, ".old");
+        unlink(name);
+        dprintf("... journal: checkpoint saved\n");
+    } // otherwise the old journal is still needed, and kept
+}
 
-    // get the parent inode
-    inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    offset = parent_inode - inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t *parent = (inode_t *) (inode_buffer + offset * sizeof(inode_t));
-    dprintf("... get parent inode %d (size=%d, type=%d)\n",
-            parent_inode, parent->size, parent->type);
+// start saving the disk image, which includes commit 'seq', in the
+// background; the caller holds 'ns_lock' exclusively, and it's
+// released here
+static void journal_checkpoint(int seq) {
+    Disk_Snapshot_t *snap = NULL;
+    if (cache_patch(SUPERBLOCK_START_SECTOR, SUPERBLOCK_SEQ * sizeof(int),
+                    (char *) &seq, sizeof(int)) == 0 && cache_flush() == 0)
+        snap = Disk_Snapshot();
+    pthread_rwlock_unlock(&ns_lock);
+    if (!snap) return; // try again with the next commit
+
+    // new records go to a fresh file, unless an earlier checkpoint
+    // failed and the old file still has records the image doesn't
+    char name[1040], old[1040];
+    journal_name(name, "");
+    journal_name(old, ".old");
+    if (access(old, F_OK) < 0) {
+        fclose(journal_file);
+        if (rename(name, old) < 0) {
+            journal_file = fopen(name, "ab");
+            Disk_SnapshotRelease(snap);
+            return;
+        }
+        journal_file = fopen(name, "wb");
+    }
+    journal_logged = 0;
+
+    journal_snap = snap;
+    journal_saving = 1;
+    memset(&journal_save, 0, sizeof(journal_save));
+    journal_save.op = DISK_OP_SAVE;
+    // the name must outlive the save, even if another disk is booted
+    strcpy(journal_image, bs_filename);
+    journal_save.buffer = journal_image;
+    journal_save.snapshot = snap;
+    journal_save.data = &journal_saving;
+    if (cache_submit(&journal_save) < 0) {
+        Disk_SnapshotRelease(snap);
+        journal_snap = NULL;
+        return;
+    }
+    dprintf("... journal: checkpoint of commit %d started\n", seq);
+}
 
-    if (parent->type != 1) {
-        dprintf("... error: parent inode is not directory\n");
-        return -2; // parent not directory
+// make a commit: write everything kept in memory to the buffer cache
+// and log the sectors that have changed; return 0 if successful, -1
+// otherwise
+static int journal_write() {
+    journal_reap();
+
+    // no changes to the name space are half done meanwhile
+    pthread_rwlock_wrlock(&ns_lock);
+    __atomic_store_n(&journal_ops, 0, __ATOMIC_RELAXED);
+    int *sectors = NULL, count = -1;
+    char *data = NULL;
+    if (iflush() == 0 && bitmap_sync(&inode_bitmap) == 0 && bitmap_sync(&sector_bitmap) == 0)
+        count = cache_changes(&sectors, &data);
+    if (count > 0 && journal_append(journal_seq + 1, sectors, data, count) < 0) {
+        cache_unchange(sectors, count);
+        count = -1;
     }
+    free(sectors);
+    free(data);
+    if (count > 0) {
+        journal_seq++;
+        journal_logged += count;
+    }
+    if (count >= 0 && journal_logged >= JOURNAL_MAX && !journal_snap)
+        journal_checkpoint(journal_seq); // releases 'ns_lock'
+    else
+        pthread_rwlock_unlock(&ns_lock);
+    return count < 0 ? -1 : 0;
+}
 
-    // get the dirent sectors and find child dirent
-    char dirent_buffer[SECTOR_SIZE];
-    for (int j = 0; j < MAX_SECTORS_PER_FILE; j++) {
-        if (parent->data[j]) {
-            if (Disk_Read(parent->data[j], dirent_buffer) < 0) { return -1; }
-            dprintf("... load disk sector %d for dirent group %d\n", parent->data[j], j + 1);
-
-            for (int k = 0; k < DIRENTS_PER_SECTOR; k++) {
-                dirent_t *dirent = (dirent_t *) (dirent_buffer + (k * sizeof(dirent_t)));
-                // found child?, remove child dirent
-                if (dirent->inode == child_inode) {
-                    dprintf("... found match: dirent inode %d, child inode %d\n", dirent->inode, child_inode);
-                    memset(dirent, 0, sizeof(dirent_t));
-                    if (Disk_Write(parent->data[j], dirent_buffer) < 0) { return -1; }
-                    parent->size--;
-                    if (Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-                    dprintf("... update parent inode on disk sector %d\n", inode_sector);
-                    return 0;
-                }
-            }
+// commit all changes made so far; return 0 if successful, -1 otherwise
+static int journal_commit() {
+    pthread_mutex_lock(&journal_lock);
+    // a commit being made now may have missed the caller's changes
+    long want = journal_started + 1;
+    while (journal_finished < want) {
+        if (journal_busy) {
+            pthread_cond_wait(&journal_done, &journal_lock);
+            continue;
         }
+        journal_busy = 1;
+        long mine = ++journal_started;
+        pthread_mutex_unlock(&journal_lock);
+        int result = journal_write();
+        pthread_mutex_lock(&journal_lock);
+        journal_result = result;
+        journal_finished = mine;
+        journal_busy = 0;
+        pthread_cond_broadcast(&journal_done);
     }
-    return -1;
+    int result = journal_result;
+    pthread_mutex_unlock(&journal_lock);
+    return result;
 }
 
-// representing an open file
-typedef struct _open_file {
-    int inode; // pointing to the inode of the file (0 means entry not used)
-    int size;  // file size cached here for convenience
-    int pos;   // read/write position
-} open_file_t;
-static open_file_t open_files[MAX_OPEN_FILES];
+// count a change to the name space, committing once there are enough;
+// the caller must not hold 'ns_lock'
+static void journal_note() {
+    if (__atomic_add_fetch(&journal_ops, 1, __ATOMIC_RELAXED) >= JOURNAL_BATCH)
+        journal_commit(); // if it fails, the changes go with the next one
+}
 
-// return true if the file pointed to by inode has already been open
-int is_file_open(int inode) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (open_files[i].inode == inode)
-            return 1;
-    }
-    return 0;
+// close the journal (before the disk is reloaded), after waiting for a
+// checkpoint being saved to complete
+static void journal_close() {
+    if (journal_snap) cache_wait(&journal_saving);
+    journal_reap();
+    if (journal_file) fclose(journal_file);
+    journal_file = NULL;
 }
 
-// return a new file descriptor not used; -1 if full
-int new_file_fd() {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (open_files[i].inode <= 0)
-            return i;
+// bring the disk up to date with the journal files and go on appending
+// to the journal; the image itself isn't saved, the records replayed
+// stay in the journal until the next checkpoint, which starts right
+// away if there are JOURNAL_MAX sectors of them; 'format' is set if the
+// disk has just been formatted, in which case any old journal is
+// discarded; return 0 if successful, -1 otherwise
+static int journal_open(int format) {
+    char name[1040], old[1040], buf[SECTOR_SIZE];
+    journal_name(name, "");
+    journal_name(old, ".old");
+    int seq = 0;
+    long oldend = 0, end = 0;
+    if (!format) {
+        if (Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0) return -1;
+        int saved = ((int *) buf)[SUPERBLOCK_SEQ];
+        int oldseq = journal_replay(old, saved, &oldend);
+        seq = journal_replay(name, oldseq, &end);
+        if (oldseq == saved) {
+            // the image has all of the old journal
+            unlink(old);
+            oldend = 0;
+        }
+    } else {
+        unlink(old);
     }
-    return -1;
+
+    // new records go after the last good one
+    if (!(journal_file = fopen(name, format ? "wb" : "ab"))) return -1;
+    if (ftruncate(fileno(journal_file), end) < 0) {
+        fclose(journal_file);
+        journal_file = NULL;
+        return -1;
+    }
+    journal_seq = seq;
+    journal_logged = (int) ((oldend + end) / SECTOR_SIZE);
+    journal_ops = 0;
+
+    // a checkpoint that didn't complete (the process ended while it was
+    // being saved) would leave every boot replaying the same records
+    if (journal_logged >= JOURNAL_MAX) {
+        pthread_rwlock_wrlock(&ns_lock);
+        journal_checkpoint(seq); // releases 'ns_lock'
+    }
+    return 0;
 }
 
 /* end of internal helper functions, start of API functions */
 
 int FS_Boot(char *backstore_fname) {
     dprintf("FS_Boot('%s'):\n", backstore_fname);
+    journal_close(); // waits for a checkpoint still being saved
+    cache_reset();   // before the disk goes away under any read-ahead
+
     // initialize a new disk (this is a simulated disk)
     if (Disk_Init() < 0) {
         dprintf("... disk init failed\n");
         osErrno = E_GENERAL;
         return -1;
     }
+    // the cache's requests complete on a queue of their own, apart from
+    // those of any other user of the disk
+    if (!cache_queue && !(cache_queue = Disk_QueueCreate())) {
+        dprintf("... failed to create the completion queue\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    icache_reset();
+    dcache_reset();
     dprintf("... disk initialized\n");
 
     // we should copy the filename down; if not, the user may change the
@@ -580,8 +2577,10 @@ int FS_Boot(char *backstore_fname) {
     strncpy(bs_filename, backstore_fname, 1024);
     bs_filename[1023] = '\0'; // for safety
 
-    // we first try to load disk from this file
-    if (Disk_Load(bs_filename) < 0) {
+    // we first try to load disk from this file; only its header is read
+    // now, sectors are read from it when they're first accessed, so
+    // booting doesn't depend on the size of the disk
+    if (Disk_Open(bs_filename) < 0) {
         dprintf("... load disk from file '%s' failed\n", bs_filename);
 
         // if we can't open the file; it means the file does not exist, we
@@ -592,8 +2591,9 @@ int FS_Boot(char *backstore_fname) {
             // format superblock
             char buf[SECTOR_SIZE];
             memset(buf, 0, SECTOR_SIZE);
-            *(int *) buf = OS_MAGIC;
-            if (Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
+            ((int *) buf)[0] = OS_MAGIC;
+            ((int *) buf)[1] = OS_VERSION;
+            if (cache_write(SUPERBLOCK_START_SECTOR, buf) < 0) {
                 dprintf("... failed to format superblock\n");
                 osErrno = E_GENERAL;
                 return -1;
@@ -620,7 +2620,7 @@ int FS_Boot(char *backstore_fname) {
                     ((inode_t *) buf)->size = 0;
                     ((inode_t *) buf)->type = 1;
                 }
-                if (Disk_Write(INODE_TABLE_START_SECTOR + i, buf) < 0) {
+                if (cache_write(INODE_TABLE_START_SECTOR + i, buf) < 0) {
                     dprintf("... failed to format inode table\n");
                     osErrno = E_GENERAL;
                     return -1;
@@ -631,15 +2631,18 @@ int FS_Boot(char *backstore_fname) {
 
             // we need to synchronize the disk to the backstore file (so
             // that we don't lose the formatted disk)
-            if (Disk_Save(bs_filename) < 0) {
+            if (bitmap_load(&inode_bitmap) < 0 || bitmap_load(&sector_bitmap) < 0 ||
+                fs_flush() < 0 || Disk_Save(bs_filename) < 0 || journal_open(1) < 0) {
                 // if can't write to file, something's wrong with the backstore
                 dprintf("... failed to save disk to file '%s'\n", bs_filename);
                 osErrno = E_GENERAL;
                 return -1;
             } else {
-                // everything's good now, boot is successful
+                // everything's good now, boot is successful; the journal
+                // starts with the next changes
                 dprintf("... successfully formatted disk, boot successful\n");
-                memset(open_files, 0, MAX_OPEN_FILES * sizeof(open_file_t));
+                cache_reset();
+                fd_reset();
                 return 0;
             }
         } else {
@@ -651,28 +2654,26 @@ int FS_Boot(char *backstore_fname) {
     } else {
         dprintf("... load disk from file '%s' successful\n", bs_filename);
 
-        // we successfully loaded the disk, we need to do two more checks,
-        // first the file size must be exactly the size as expected (thiis
-        // supposedly should be folded in Disk_Load(); and it's not)
-        int sz = 0;
-        FILE *f = fopen(bs_filename, "r");
-        if (f) {
-            fseek(f, 0, SEEK_END);
-            sz = ftell(f);
-            fclose(f);
-        }
-        if (sz != SECTOR_SIZE * TOTAL_SECTORS) {
-            dprintf("... check size of file '%s' failed\n", bs_filename);
-            osErrno = E_GENERAL;
-            return -1;
-        }
-        dprintf("... check size of file '%s' successful\n", bs_filename);
-
-        // check magic
+        // we successfully opened the disk; Disk_Open() already checked
+        // the size and header of the image (each sector is checked when
+        // it's read), so what's left is to make sure it holds our file
+        // system: check magic
         if (check_magic()) {
-            // everything's good by now, boot is successful
+            // everything's good by now, boot is successful once the
+            // journal is replayed and the bitmaps are in memory
             dprintf("... check magic successful\n");
-            memset(open_files, 0, MAX_OPEN_FILES * sizeof(open_file_t));
+            if (journal_open(0) < 0) {
+                dprintf("... failed to replay the journal, boot failed\n");
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            cache_reset(); // the replay went straight to the disk
+            if (bitmap_load(&inode_bitmap) < 0 || bitmap_load(&sector_bitmap) < 0) {
+                dprintf("... failed to load bitmaps, boot failed\n");
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            fd_reset();
             return 0;
         } else {
             // mismatched magic number
@@ -684,42 +2685,50 @@ int FS_Boot(char *backstore_fname) {
 }
 
 int FS_Sync() {
-    if (Disk_Save(bs_filename) < 0) {
-        // if can't write to file, something's wrong with the backstore
-        dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
+    if (journal_commit() < 0) {
+        // if can't write to the journal, something's wrong with the backstore
+        dprintf("FS_Sync():\n... failed to commit to the journal of '%s'\n", bs_filename);
         osErrno = E_GENERAL;
         return -1;
     } else {
         // everything's good now, sync is successful
-        dprintf("FS_Sync():\n... successfully saved disk to file '%s'\n", bs_filename);
+        dprintf("FS_Sync():\n... successfully committed to the journal of '%s'\n", bs_filename);
+        dprintf("... buffer cache: %d hits, %d misses\n", cache_hits, cache_misses);
         return 0;
     }
 }
 
+int FS_CacheStats(int *hits, int *misses) {
+    pthread_mutex_lock(&cache_lock);
+    if (hits) *hits = cache_hits;
+    if (misses) *misses = cache_misses;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
 int File_Create(char *file) {
     dprintf("File_Create('%s'):\n", file);
     return create_file_or_directory(0, file);
 }
 
 int delete_file_or_dir(int type, char *pathname) {
-    int child_inode;
+    int child_inode = -1, ret = -1;
     char last_fname[MAX_NAME];
+    pthread_rwlock_wrlock(&ns_lock);
     int parent_inode = follow_path(pathname, &child_inode, last_fname);
 
-    // if it is a file and is open
     if (!type && is_file_open(child_inode)) {
+        // if it is a file and is open
         dprintf("... file '%s' is currently open\n", last_fname);
         osErrno = E_FILE_IN_USE;
-        return -1;
-    }
-
-    if (parent_inode >= 0) {
+    } else if (parent_inode >= 0) {
         if (child_inode >= 0) {
-            int operation = remove_inode(type, parent_inode, child_inode);
+            int operation = remove_inode(type, parent_inode, child_inode, last_fname);
             if (!operation) {
+                dcache_forget(pathname, type);
                 dprintf("... file/directory '%s' successfully Unlinked\n", pathname);
                 // successful removal
-                return 0;
+                ret = 0;
             } else {
                 if (operation == -2) {
                     dprintf("... directory '%s' is not empty.\n", pathname);
@@ -731,19 +2740,171 @@ int delete_file_or_dir(int type, char *pathname) {
                     dprintf("... file/directory '%s' unable to Unlink\n", pathname);
                     osErrno = E_GENERAL;
                 }
-                return -1;
             }
         } else {
             dprintf("... file/directory '%s' does not exists.\n", pathname);
             if (type) { osErrno = E_NO_SUCH_DIR; }
             else { osErrno = E_NO_SUCH_FILE; }
-            return -1;
         }
     } else {
         dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
         osErrno = E_GENERAL;
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    if (!ret) journal_note();
+    return ret;
+}
+
+// return the directory 'path', locked exclusively, and its index
+// through 'dx', for the batch calls below; return NULL (with osErrno
+// set) if there's no such directory; the caller holds 'ns_lock'
+static minode_t *batch_dir(char *path, dirindex_t **dx) {
+    int inode = -1;
+    follow_path(path, &inode, NULL);
+    if (inode < 0) {
+        dprintf("... directory '%s' is not found\n", path);
+        osErrno = E_NO_SUCH_DIR;
+        return NULL;
+    }
+    minode_t *ip = iget(inode);
+    if (!ip) {
+        osErrno = E_GENERAL;
+        return NULL;
+    }
+    pthread_rwlock_wrlock(&ip->lock);
+    *dx = ip->d.type == 1 ? dir_index(ip) : NULL;
+    if (!*dx) {
+        dprintf("... error: '%s' is not a directory\n", path);
+        pthread_rwlock_unlock(&ip->lock);
+        iput(ip);
+        osErrno = E_GENERAL;
+        return NULL;
+    }
+    return ip;
+}
+
+// forget what the dentry cache knows about 'name' in directory 'path'
+static void batch_forget(char *path, char *name, int subtree) {
+    char full[MAX_PATH];
+    snprintf(full, MAX_PATH, "%s/%s", path, name);
+    dcache_forget(full, subtree);
+}
+
+// used by both File_CreateBatch() and Dir_CreateBatch(); the directory
+// is looked up once, the inodes are taken from the bitmap in one pass
+// and the entries are appended at once, each dirent sector written once
+static int create_batch(int type, char *path, char **names, int count) {
+    pthread_rwlock_wrlock(&ns_lock);
+    dirindex_t *dx;
+    minode_t *ip = batch_dir(path, &dx);
+    if (!ip) {
+        pthread_rwlock_unlock(&ns_lock);
+        return -1;
+    }
+    int size = ip->d.size;
+
+    // the names are entered in the index as they are checked, which
+    // catches the ones repeated in the batch as well
+    int n = 0;
+    while (n < count && !illegal_filename(names[n]) && !strchr(names[n], '/') &&
+           dir_index_find(dx, names[n]) < 0 &&
+           dir_index_add(dx, size + n, names[n], -1) == 0)
+        n++;
+    if (n < count) {
+        dprintf("... cannot create '%s'\n", names[n]);
+        osErrno = E_CREATE;
+    }
+    int checked = n;
+    int *inodes = malloc((n ? n : 1) * sizeof(int));
+    dirent_t *dirents = calloc(n ? n : 1, sizeof(dirent_t));
+    if (!inodes || !dirents) {
+        osErrno = E_GENERAL;
+        n = 0;
+    } else if ((n = bitmap_alloc_many(&inode_bitmap, n, inodes)) < checked) {
+        dprintf("... error: inode table is full\n");
+        osErrno = E_CREATE;
+    }
+
+    // the new inodes are set up before their entries appear
+    for (int i = 0; i < n; i++) {
+        minode_t *child = iget(inodes[i]);
+        if (!child) {
+            for (int j = i; j < n; j++)
+                bitmap_reset(&inode_bitmap, inodes[j]);
+            osErrno = E_CREATE;
+            n = i;
+            break;
+        }
+        pthread_rwlock_wrlock(&child->lock);
+        memset(&child->d, 0, sizeof(inode_t));
+        child->d.type = type;
+        child->dirty = 1;
+        pthread_rwlock_unlock(&child->lock);
+        iput(child);
+        strncpy(dirents[i].fname, names[i], MAX_NAME);
+        dirents[i].inode = inodes[i];
+        dx->slots[size + i].inode = inodes[i];
+    }
+    if (n > 0 && dirent_append(ip, dirents, n) < 0) {
+        dprintf("... error: disk is full\n");
+        osErrno = E_CREATE;
+        for (int i = 0; i < n; i++)
+            bitmap_reset(&inode_bitmap, inodes[i]);
+        n = 0;
+    }
+    for (int i = checked - 1; i >= n; i--)
+        dir_index_unlink(dx, size + i);
+    pthread_rwlock_unlock(&ip->lock);
+    iput(ip);
+
+    for (int i = 0; i < n; i++)
+        batch_forget(path, names[i], 0);
+    pthread_rwlock_unlock(&ns_lock);
+    free(inodes);
+    free(dirents);
+    dprintf("... created %d of %d\n", n, count);
+    if (n > 0) journal_note();
+    return n;
+}
+
+// used by both File_UnlinkBatch() and Dir_UnlinkBatch(); the directory
+// is looked up once and stays locked while its entries are removed
+static int unlink_batch(int type, char *path, char **names, int count) {
+    pthread_rwlock_wrlock(&ns_lock);
+    dirindex_t *dx;
+    minode_t *ip = batch_dir(path, &dx);
+    if (!ip) {
+        pthread_rwlock_unlock(&ns_lock);
         return -1;
     }
+    int n;
+    for (n = 0; n < count; n++) {
+        int slot = dir_index_find(dx, names[n]);
+        if (slot < 0) {
+            dprintf("... file/directory '%s' does not exists.\n", names[n]);
+            osErrno = type ? E_NO_SUCH_DIR : E_NO_SUCH_FILE;
+            break;
+        }
+        int child_inode = dx->slots[slot].inode;
+        if (!type && is_file_open(child_inode)) {
+            dprintf("... file '%s' is currently open\n", names[n]);
+            osErrno = E_FILE_IN_USE;
+            break;
+        }
+        int err = inode_release(type, child_inode);
+        if (!err) err = dirent_remove(ip, dx, slot);
+        if (err) {
+            osErrno = err == -2 ? E_DIR_NOT_EMPTY : E_GENERAL;
+            break;
+        }
+        batch_forget(path, names[n], type);
+    }
+    pthread_rwlock_unlock(&ip->lock);
+    iput(ip);
+    pthread_rwlock_unlock(&ns_lock);
+    dprintf("... removed %d of %d\n", n, count);
+    if (n > 0) journal_note();
+    return n;
 }
 
 /**
@@ -763,200 +2924,360 @@ int File_Unlink(char *file) {
     return delete_file_or_dir(0, file);
 }
 
+int File_CreateBatch(char *path, char **names, int count) {
+    dprintf("File_CreateBatch('%s', %d):\n", path, count);
+    return create_batch(0, path, names, count);
+}
+
+int File_UnlinkBatch(char *path, char **names, int count) {
+    dprintf("File_UnlinkBatch('%s', %d):\n", path, count);
+    return unlink_batch(0, path, names, count);
+}
+
 int File_Open(char *file) {
     dprintf("File_Open('%s'):\n", file);
-    int fd = new_file_fd();
+    pthread_mutex_lock(&fd_lock);
+    int fd = fd_nfree > 0 || fd_top < MAX_OPEN_FILES ? 0 : -1;
+    pthread_mutex_unlock(&fd_lock);
     if (fd < 0) {
         dprintf("... max open files reached\n");
         osErrno = E_TOO_MANY_OPEN_FILES;
         return -1;
     }
 
-    int child_inode;
+    // the file can't be removed until the descriptor is in the table
+    pthread_rwlock_rdlock(&ns_lock);
+    int child_inode = -1;
     follow_path(file, &child_inode, NULL);
-    if (child_inode >= 0) {
-        // get inode for child
-        inode_t *child = loadInode(child_inode);
-        if (child->type != 0) {
-            dprintf("... error: '%s' is not a file\n", file);
-            osErrno = E_GENERAL;
-            return -1;
-        }
-        // initialize open file entry and return its index
-        open_files[fd].inode = child_inode;
-        open_files[fd].size = child->size;
-        open_files[fd].pos = 0;
-        return fd;
-    } else {
+    if (child_inode < 0) {
+        pthread_rwlock_unlock(&ns_lock);
         dprintf("... file '%s' is not found\n", file);
         osErrno = E_NO_SUCH_FILE;
         return -1;
     }
-}
-
-int File_Read(int fd, void *buffer, int size) {
-    // TODO File_Read
-    int bytesRead = 0;
-    open_file_t openFileEntry = open_files[fd];
-    // check to see if file is open
-    if (openFileEntry.inode == 0) {
-        dprintf("...file not open");
-        osErrno = E_BAD_FD;
+    // get inode for child; it stays in core while the file is open
+    minode_t *child = iget(child_inode);
+    if (!child) {
+        pthread_rwlock_unlock(&ns_lock);
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    pthread_rwlock_rdlock(&child->lock);
+    int type = child->d.type;
+    pthread_rwlock_unlock(&child->lock);
+    if (type != 0) {
+        pthread_rwlock_unlock(&ns_lock);
+        dprintf("... error: '%s' is not a file\n", file);
+        iput(child);
+        osErrno = E_GENERAL;
         return -1;
     }
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR + openFileEntry.inode / INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if (Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-    dprintf("\n... load inode from disk sector %d\n", inode_sector);
-
-    // get the inode
-    int inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    int offset = openFileEntry.inode - inode_start_entry;
-
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t *inode = (inode_t *) (inode_buffer + offset * sizeof(inode_t));
 
-    // next sector to be read
-    int nextSector = openFileEntry.pos / SECTOR_SIZE;
-    // if position is at end, or sector is not valid
-    if (openFileEntry.pos == MAX_FILE_SIZE || !inode->data[nextSector]) { return 0; }
+    // initialize open file entry and return its index; other threads
+    // may have taken the last descriptors in the meantime
+    pthread_mutex_lock(&fd_lock);
+    fd = new_file_fd();
+    if (fd >= 0) {
+        open_file_t *openFile = OPEN_FILE(fd);
+        openFile->inode = child_inode;
+        openFile->ip = child;
+        openFile->pos = 0;
+        openFile->ra_next = 0;
+        openFile->ra_end = 0;
+        openFile->ra_window = 0;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    if (fd >= 0) iopen(child, 1);
+    pthread_rwlock_unlock(&ns_lock);
+    if (fd < 0) {
+        dprintf("... max open files reached\n");
+        iput(child);
+        osErrno = E_TOO_MANY_OPEN_FILES;
+    }
+    return fd;
+}
 
-    char sectorBuffer[SECTOR_SIZE];
-    if (Disk_Read(inode->data[nextSector], sectorBuffer) < 0) { return -1; }
-    dprintf("... load disk sector %d\n", inode->data[nextSector]);
+// return the open file of the given file descriptor, or NULL (with
+// osErrno set) if the descriptor is not valid; a descriptor must not
+// be closed while other threads are still using it
+static open_file_t *get_open_file(int fd) {
+    pthread_mutex_lock(&fd_lock);
+    int valid = fd >= 0 && fd < fd_top && OPEN_FILE(fd)->ip && !OPEN_FILE(fd)->dir;
+    pthread_mutex_unlock(&fd_lock);
+    if (!valid) {
+        dprintf("... fd=%d not an open file\n", fd);
+        osErrno = E_BAD_FD;
+        return NULL;
+    }
+    return OPEN_FILE(fd);
+}
 
-    void *bufferWriter = buffer;
-    void *readingPosition = sectorBuffer + (open_files[fd].pos - (openFileEntry.pos / SECTOR_SIZE) * SECTOR_SIZE);
+// the read-ahead window of a file being read sequentially starts at
+// READAHEAD_MIN blocks and doubles with every read up to READ_BATCH
+#define READAHEAD_MIN 8
+
+// read up to 'size' bytes of an open file from position 'pos' on and
+// return the number of bytes read; return -1 (with osErrno set) on
+// error; used by both File_Read() and File_ReadAt()
+static int file_read(open_file_t *openFile, int pos, char *buffer, int size) {
+    minode_t *ip = openFile->ip;
+    inode_t *inode = &ip->d;
+    if (size < 0) size = 0; // nothing to read, as with a size of zero
+
+    // readers share the inode lock, so anything that changes the inode
+    // (writing out buffered data, building the extent map) is done
+    // first with the lock held exclusively
+    pthread_rwlock_rdlock(&ip->lock);
+    while (ip->wlen || !ip->map) {
+        pthread_rwlock_unlock(&ip->lock);
+        pthread_rwlock_wrlock(&ip->lock);
+        int err = file_flush(ip);
+        if (!err && inode_map(ip) < 0) {
+            osErrno = E_GENERAL;
+            err = -1;
+        }
+        pthread_rwlock_unlock(&ip->lock);
+        if (err < 0) return -1;
+        pthread_rwlock_rdlock(&ip->lock);
+    }
+    if (pos < 0 || pos > inode->size) {
+        pthread_rwlock_unlock(&ip->lock);
+        osErrno = E_SEEK_OUT_OF_BOUNDS;
+        return -1;
+    }
 
     // read file data until EOF or until requested size bytes have been read
-    while (open_files[fd].pos < MAX_FILE_SIZE && size > 0 && inode->data[nextSector]) {
-
-        if (size >= SECTOR_SIZE) {
-            dprintf("... Reading BYTE  %d\n", open_files[fd].pos);
-            memcpy(bufferWriter, readingPosition, SECTOR_SIZE);
-            size -= SECTOR_SIZE;
-            bufferWriter += SECTOR_SIZE;
-            bytesRead += SECTOR_SIZE;
-            open_files[fd].pos += SECTOR_SIZE;
-            nextSector++;
-            // check if there is more data available
-            if (open_files[fd].pos < MAX_FILE_SIZE) {
-                if (Disk_Read(inode->data[nextSector], sectorBuffer) < 0) { return -1; }
-                readingPosition = sectorBuffer;
-            } else { return bytesRead; }
-
+    if (size > inode->size - pos)
+        size = inode->size - pos;
+    pthread_mutex_lock(&fd_lock);
+    int ra_next = openFile->ra_next, ra_end = openFile->ra_end, ra_window = openFile->ra_window;
+    pthread_mutex_unlock(&fd_lock);
+    int sequential = pos / SECTOR_SIZE == ra_next;
+    int bytesRead = 0;
+    if (inode->flags & INODE_INLINE) {
+        // the data is right there in the inode
+        memcpy(buffer, inode->data + pos, (size_t) size);
+        dprintf("... read %d bytes inline\n", size);
+        bytesRead = size;
+        pos += size;
+    }
+    while (bytesRead < size) {
+        int sector = pos / SECTOR_SIZE;
+        int offset = pos % SECTOR_SIZE;
+        int n = SECTOR_SIZE - offset;
+        if (n > size - bytesRead) n = size - bytesRead;
+
+        int run;
+        int disk_sector = inode_block(ip, sector, &run);
+        if (offset == 0 && n == SECTOR_SIZE) {
+            // whole sectors go straight into the caller's buffer, as many
+            // as are stored consecutively on disk
+            int count = (size - bytesRead) / SECTOR_SIZE;
+            if (count > run) count = run;
+            if (disk_sector < 0 || cache_read_direct(disk_sector, count, buffer + bytesRead) < 0) {
+                pthread_rwlock_unlock(&ip->lock);
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            n = count * SECTOR_SIZE;
         } else {
-            dprintf("... Reading BYTE  %d\n", open_files[fd].pos);
-            memcpy(bufferWriter, readingPosition, (size_t) size);
-            bytesRead += size;
-            open_files[fd].pos += size;
-            return bytesRead;
+            if (cache_copy(disk_sector, offset, buffer + bytesRead, n) < 0) {
+                pthread_rwlock_unlock(&ip->lock);
+                osErrno = E_GENERAL;
+                return -1;
+            }
+        }
+        dprintf("... read %d bytes from disk sector %d\n", n, disk_sector);
+        bytesRead += n;
+        pos += n;
+    }
+
+    // keep reading ahead of a file read sequentially
+    int next = pos / SECTOR_SIZE;
+    int nblocks = (inode->size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (sequential && bytesRead > 0) {
+        int window = ra_window * 2;
+        if (window < READAHEAD_MIN) window = READAHEAD_MIN;
+        if (window > READ_BATCH) window = READ_BATCH;
+        ra_window = window;
+        int from = next > ra_end ? next : ra_end;
+        int to = next + window < nblocks ? next + window : nblocks;
+        while (from < to) {
+            int run;
+            int disk_sector = inode_block(ip, from, &run);
+            if (disk_sector < 0) break;
+            if (run > to - from) run = to - from;
+            cache_readahead(disk_sector, run);
+            from += run;
         }
+        if (to > ra_end) ra_end = to;
+    } else if (!sequential) {
+        ra_window = 0;
+        ra_end = 0;
     }
+    pthread_rwlock_unlock(&ip->lock);
+    pthread_mutex_lock(&fd_lock);
+    openFile->ra_next = next;
+    openFile->ra_end = ra_end;
+    openFile->ra_window = ra_window;
+    pthread_mutex_unlock(&fd_lock);
     return bytesRead;
 }
 
-int File_Write(int fd, void *buffer, int size) {
-    // TODO File_Write
-    int bytesWriten = size;
-    void *bufferReader = buffer;
-    open_file_t openFileEntry = open_files[fd];
-    //check if file is not open
-    if (openFileEntry.inode == 0) {
-        dprintf("... file not open");
-        osErrno = E_BAD_FD;
+int File_Read(int fd, void *buffer, int size) {
+    dprintf("File_Read(%d, %d):\n", fd, size);
+    open_file_t *openFile = get_open_file(fd);
+    if (!openFile) return -1;
+    pthread_mutex_lock(&fd_lock);
+    int pos = openFile->pos;
+    pthread_mutex_unlock(&fd_lock);
+    int n = file_read(openFile, pos, buffer, size);
+    if (n > 0) {
+        pthread_mutex_lock(&fd_lock);
+        openFile->pos = pos + n;
+        pthread_mutex_unlock(&fd_lock);
+    }
+    return n;
+}
+
+int File_ReadAt(int fd, void *buffer, int size, int offset) {
+    dprintf("File_ReadAt(%d, %d, %d):\n", fd, size, offset);
+    open_file_t *openFile = get_open_file(fd);
+    if (!openFile) return -1;
+    return file_read(openFile, offset, buffer, size);
+}
+
+// small writes are collected in a buffer kept with the in-core inode
+// (and so shared by all descriptors of the file) as long as each one
+// continues where the previous one ended; sectors are only allocated
+// and written when the buffer is flushed: when it's full, when the file
+// is written elsewhere, read, or closed, and by FS_Sync(); by then the
+// allocator knows how much data there is and can place it together;
+// meanwhile, the number of sectors it will need is reserved
+#define WRITE_BUFFER (64 * SECTOR_SIZE)
+
+// write 'size' bytes to a file at position 'pos', buffering them if
+// possible, and return the number of bytes written; return -1 (with
+// osErrno set) on error; the caller holds the inode lock exclusively
+static int file_write_buffered(minode_t *ip, int pos, char *buffer, int size) {
+    if (pos < 0 || pos > ip->d.size) {
+        osErrno = E_SEEK_OUT_OF_BOUNDS;
         return -1;
     }
+
     // check if there is enough space
-    if ((openFileEntry.size + size) > MAX_FILE_SIZE) {
-        dprintf("... file is too big.");
+    if (size < 0 || pos + size > MAX_FILE_SIZE) {
+        dprintf("... file is too big\n");
         osErrno = E_FILE_TOO_BIG;
         return -1;
     }
-    char sectorBuffer[SECTOR_SIZE];
-    inode_t *fileInode;
-    // read sector containing inode
-    Disk_Read(INODE_TABLE_START_SECTOR + (openFileEntry.inode / INODES_PER_SECTOR), sectorBuffer);
-    // calculate offset within the sector
-    int offset = openFileEntry.inode - (openFileEntry.inode / INODES_PER_SECTOR) * INODES_PER_SECTOR;
-
-    fileInode = (inode_t *) sectorBuffer + offset;
-    int sectorsNeeded = (size / SECTOR_SIZE) + 1;
-
-    // request free sectors and write
-    for (int i = 0; i < sectorsNeeded; i++) {
-        char sector[SECTOR_SIZE];
-        int sectorIndex = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-
-        // if no sectors left
-        if (sectorIndex < 0) {
-            osErrno = E_NO_SPACE;
-            dprintf("... no space left.");
-            Disk_Write(INODE_TABLE_START_SECTOR + (openFileEntry.inode / INODES_PER_SECTOR), sectorBuffer);
-            return -1;
-        }
-        fileInode->data[i] = sectorIndex;
-        Disk_Read(sectorIndex, sector);
 
-        // write buffer to sector. Buffer might be bigger than sector
-        // need to request more sectors
-        if (size > SECTOR_SIZE) {
-            size -= SECTOR_SIZE;
-            memcpy(sector, bufferReader, SECTOR_SIZE);
-            bufferReader += SECTOR_SIZE;
-            fileInode->size += SECTOR_SIZE;
-        } else {
-            memcpy(sector, bufferReader, (size_t) size);
-            bufferReader += size;
-            fileInode->size += size;
-            size = 0;
-        }
-        openFileEntry.size = fileInode->size;
-        openFileEntry.pos = fileInode->size;
-        Disk_Write(sectorIndex, sector);
+    // the buffered data must be written first if this write doesn't
+    // follow it or doesn't fit
+    if (ip->wlen && (pos != ip->wpos + ip->wlen || ip->wlen + size > WRITE_BUFFER)) {
+        if (file_flush(ip) < 0) return -1;
     }
-    Disk_Write(INODE_TABLE_START_SECTOR + (openFileEntry.inode / INODES_PER_SECTOR), sectorBuffer);
-    return bytesWriten - size;
+    if (!ip->wbuf && size < WRITE_BUFFER)
+        ip->wbuf = malloc(WRITE_BUFFER); // if that fails, writes go straight through
+    if (size >= WRITE_BUFFER || !ip->wbuf)
+        return file_write_at(ip, pos, buffer, size);
+
+    // when the disk is nearly full, the write goes straight through, so
+    // that running out of space is reported to the caller
+    if (wbuf_reserve(ip, pos + size) < 0) {
+        if (file_flush(ip) < 0) return -1;
+        return file_write_at(ip, pos, buffer, size);
+    }
+
+    // buffer it; the file grows right away
+    if (!ip->wlen) ip->wpos = pos;
+    memcpy(ip->wbuf + ip->wlen, buffer, (size_t) size);
+    ip->wlen += size;
+    if (pos + size > ip->d.size) {
+        ip->d.size = pos + size;
+        ip->dirty = 1;
+    }
+    return size;
 }
 
-int File_Seek(int fd, int offset) {
-    // TODO File_Seek
-    open_file_t openFileEntry = open_files[fd];
-    //check if file is not open
-    if (openFileEntry.inode == 0) {
-        dprintf("... file not open");
-        osErrno = E_BAD_FD;
-        return -1;
+// write 'size' bytes to an open file at position 'pos' and return the
+// number of bytes written; return -1 (with osErrno set) on error; used
+// by both File_Write() and File_WriteAt()
+static int file_write(open_file_t *openFile, int pos, char *buffer, int size) {
+    pthread_rwlock_wrlock(&openFile->ip->lock);
+    int n = file_write_buffered(openFile->ip, pos, buffer, size);
+    pthread_rwlock_unlock(&openFile->ip->lock);
+    return n;
+}
+
+int File_Write(int fd, void *buffer, int size) {
+    dprintf("File_Write(%d, %d):\n", fd, size);
+    open_file_t *openFile = get_open_file(fd);
+    if (!openFile) return -1;
+    pthread_mutex_lock(&fd_lock);
+    int pos = openFile->pos;
+    pthread_mutex_unlock(&fd_lock);
+    int n = file_write(openFile, pos, buffer, size);
+    if (n > 0) {
+        pthread_mutex_lock(&fd_lock);
+        openFile->pos = pos + n;
+        pthread_mutex_unlock(&fd_lock);
     }
+    return n;
+}
+
+int File_WriteAt(int fd, void *buffer, int size, int offset) {
+    dprintf("File_WriteAt(%d, %d, %d):\n", fd, size, offset);
+    open_file_t *openFile = get_open_file(fd);
+    if (!openFile) return -1;
+    return file_write(openFile, offset, buffer, size);
+}
+
+int File_Seek(int fd, int offset) {
+    dprintf("File_Seek(%d, %d):\n", fd, offset);
+    open_file_t *openFile = get_open_file(fd);
+    if (!openFile) return -1;
 
     //If offset is larger than the size of
     //the file or negative
-    if (offset > openFileEntry.size || offset < 0) {
+    pthread_rwlock_rdlock(&openFile->ip->lock);
+    int size = openFile->ip->d.size;
+    pthread_rwlock_unlock(&openFile->ip->lock);
+    if (offset > size || offset < 0) {
         osErrno = E_SEEK_OUT_OF_BOUNDS;
         return -1;
     }
 
-    open_files[fd].pos = offset;
-    return open_files[fd].pos;
+    pthread_mutex_lock(&fd_lock);
+    openFile->pos = offset;
+    pthread_mutex_unlock(&fd_lock);
+    return offset;
 }
 
 int File_Close(int fd) {
     dprintf("File_Close(%d):\n", fd);
-    if (0 > fd || fd > MAX_OPEN_FILES) {
-        dprintf("... fd=%d out of bound\n", fd);
-        osErrno = E_BAD_FD;
-        return -1;
-    }
-    if (open_files[fd].inode <= 0) {
-        dprintf("... fd=%d not an open file\n", fd);
-        osErrno = E_BAD_FD;
+    open_file_t *openFile = get_open_file(fd);
+    if (!openFile) return -1;
+
+    // write the data and the inode back now that the file is done with;
+    // if the data can't be written, the file is closed all the same
+    minode_t *ip = openFile->ip;
+    pthread_rwlock_wrlock(&ip->lock);
+    int err = file_flush(ip);
+    if (!err && ip->dirty && iupdate(ip) < 0) {
+        pthread_rwlock_unlock(&ip->lock);
+        osErrno = E_GENERAL;
         return -1;
     }
-
-    dprintf("... file closed successfully\n");
-    open_files[fd].inode = 0;
-    return 0;
+    pthread_rwlock_unlock(&ip->lock);
+
+    pthread_mutex_lock(&fd_lock);
+    free_file_fd(fd);
+    pthread_mutex_unlock(&fd_lock);
+    iopen(ip, -1);
+    iput(ip);
+    if (!err) dprintf("... file closed successfully\n");
+    return err;
 }
 
 int Dir_Create(char *path) {
@@ -970,80 +3291,324 @@ int Dir_Unlink(char *path) {
     return delete_file_or_dir(1, path);
 }
 
-int Dir_Size(char *path) {
-    // TODO Dir_Size
-    int inode_index;
+int Dir_CreateBatch(char *path, char **names, int count) {
+    dprintf("Dir_CreateBatch('%s', %d):\n", path, count);
+    return create_batch(1, path, names, count);
+}
+
+int Dir_UnlinkBatch(char *path, char **names, int count) {
+    dprintf("Dir_UnlinkBatch('%s', %d):\n", path, count);
+    return unlink_batch(1, path, names, count);
+}
+
+// return the size of a directory in bytes; the caller holds 'ns_lock'
+static int dir_size(char *path) {
+    int inode_index = -1;
     follow_path(path, &inode_index, NULL);
 
     if (inode_index >= 0) {
-        inode_t *dir_inode = loadInode(inode_index);
-
-        if (dir_inode->type != 1) {
+        minode_t *ip = iget(inode_index);
+        if (!ip) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        pthread_rwlock_rdlock(&ip->lock);
+        int type = ip->d.type;
+        int size = (int) (ip->d.size * sizeof(dirent_t));
+        pthread_rwlock_unlock(&ip->lock);
+        iput(ip);
+        if (type != 1) {
             dprintf("... error: '%s' is not a directory\n", path);
             osErrno = E_GENERAL;
             return -1;
         }
-        dprintf("... RETURNING SIZE: '%d' \n", (int) (dir_inode->size * sizeof(dirent_t)));
-
-        return (int) (dir_inode->size * sizeof(dirent_t));
+        dprintf("... RETURNING SIZE: '%d' \n", size);
+        return size;
     } else {
         dprintf("... directory '%s' is not found\n", path);
         return 0;
     }
 }
 
+int Dir_Size(char *path) {
+    dprintf("Dir_Size('%s'):\n", path);
+    pthread_rwlock_rdlock(&ns_lock);
+    int size = dir_size(path);
+    pthread_rwlock_unlock(&ns_lock);
+    return size;
+}
+
 int Dir_Read(char *path, void *buffer, int size) {
-    // TODO Dir_Read
-    int dirSize = Dir_Size(path);
-    int inode_index;
+    dprintf("Dir_Read('%s', %d):\n", path, size);
+    pthread_rwlock_rdlock(&ns_lock);
+    int dirSize = dir_size(path);
+    int inode_index = -1;
     follow_path(path, &inode_index, NULL);
 
     // check if buffer is big enough
     if (dirSize > size) {
+        pthread_rwlock_unlock(&ns_lock);
         osErrno = E_BUFFER_TOO_SMALL;
         return -1;
     }
 
     if (inode_index >= 0) {
-        inode_t *dir_inode = loadInode(inode_index);
+        minode_t *ip = iget(inode_index);
+        if (!ip) {
+            pthread_rwlock_unlock(&ns_lock);
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        // the extent map may have to be built
+        pthread_rwlock_wrlock(&ip->lock);
+        inode_t *dir_inode = &ip->d;
 
         // copy dirent into buffer
-        void *writer = buffer;
-        int blocks = dir_inode->size / DIRENTS_PER_SECTOR;
-
-        for (int i = 0; i <= blocks; i++) {
-            char sector[SECTOR_SIZE];
-            if (Disk_Read(dir_inode->data[i], sector) < 0) { return -1; }
-            dprintf("... load sector %d\n", dir_inode->data[i]);
-            // TODO need to check
-            memcpy(writer, sector, dirSize);
-            writer += dirSize;
+        dirent_t *writer = buffer;
+        int remaining = dir_inode->size;
+        for (int i = 0; remaining > 0; i++) {
+            int n = remaining < DIRENTS_PER_SECTOR ? remaining : DIRENTS_PER_SECTOR;
+            if (dirent_copy(ip, i * DIRENTS_PER_SECTOR, writer, n) < 0) {
+                pthread_rwlock_unlock(&ip->lock);
+                pthread_rwlock_unlock(&ns_lock);
+                iput(ip);
+                return -1;
+            }
+            dprintf("... load dirent group %d\n", i);
+            writer += n;
+            remaining -= n;
         }
         dprintf(".. SIZE: '%d' \n", dir_inode->size);
 
-        return dir_inode->size;
+        int entries = dir_inode->size;
+        pthread_rwlock_unlock(&ip->lock);
+        pthread_rwlock_unlock(&ns_lock);
+        iput(ip);
+        return entries;
     } else {
+        pthread_rwlock_unlock(&ns_lock);
         dprintf("... directory '%s' is not found\n", path);
         return -1;
     }
 }
 
-inode_t *loadInode(int inode_index) {
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR + inode_index / INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if (Disk_Read(inode_sector, inode_buffer) < 0) {
+// open a stream on a directory, whose entries are then returned a few
+// at a time by Dir_Next() or Dir_NextPlus(), and return its descriptor
+// (taken from the open file table); return -1 (with osErrno set) on
+// error
+int Dir_Open(char *path) {
+    dprintf("Dir_Open('%s'):\n", path);
+    pthread_rwlock_rdlock(&ns_lock);
+    int inode_index = -1;
+    follow_path(path, &inode_index, NULL);
+    if (inode_index < 0) {
+        pthread_rwlock_unlock(&ns_lock);
+        dprintf("... directory '%s' is not found\n", path);
+        osErrno = E_NO_SUCH_DIR;
+        return -1;
+    }
+    minode_t *ip = iget(inode_index);
+    if (!ip) {
+        pthread_rwlock_unlock(&ns_lock);
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    pthread_rwlock_wrlock(&ip->lock);
+    if (ip->d.type != 1) {
+        pthread_rwlock_unlock(&ip->lock);
+        pthread_rwlock_unlock(&ns_lock);
+        dprintf("... error: '%s' is not a directory\n", path);
+        iput(ip);
         osErrno = E_GENERAL;
+        return -1;
+    }
+
+    // the directory keeps a list of its streams, so that their cursors
+    // can be moved along with the entries (see remove_inode())
+    pthread_mutex_lock(&fd_lock);
+    int dd = new_file_fd();
+    if (dd >= 0) {
+        open_file_t *stream = OPEN_FILE(dd);
+        stream->inode = inode_index;
+        stream->ip = ip;
+        stream->dir = 1;
+        stream->pos = 0;
+        stream->snext = ip->streams;
+        ip->streams = stream;
+    }
+    pthread_mutex_unlock(&fd_lock);
+    pthread_rwlock_unlock(&ip->lock);
+    pthread_rwlock_unlock(&ns_lock);
+    if (dd < 0) {
+        dprintf("... max open files reached\n");
+        iput(ip);
+        osErrno = E_TOO_MANY_OPEN_FILES;
+    }
+    return dd;
+}
+
+// return the directory stream of the given descriptor, or NULL (with
+// osErrno set) if the descriptor is not valid
+static open_file_t *get_open_dir(int dd) {
+    pthread_mutex_lock(&fd_lock);
+    int valid = dd >= 0 && dd < fd_top && OPEN_FILE(dd)->ip && OPEN_FILE(dd)->dir;
+    pthread_mutex_unlock(&fd_lock);
+    if (!valid) {
+        dprintf("... dd=%d not an open directory\n", dd);
+        osErrno = E_BAD_FD;
         return NULL;
     }
-    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
-
-    // get the inode
-    int inode_start_entry = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-    int offset = inode_index - inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t *inode = (inode_t *) (inode_buffer + offset * sizeof(inode_t));
-    dprintf("... inode %d (size=%d, type=%d)\n",
-            inode_index, inode->size, inode->type);
-    return inode;
-}
\ No newline at end of file
+    return OPEN_FILE(dd);
+}
+
+// give back the entries 'from' to 'end' of a directory stream, which
+// dir_next() handed out but couldn't be returned after all; that's only
+// possible if no other thread has moved the cursor past them meanwhile
+static void dir_unread(open_file_t *stream, int from, int end) {
+    pthread_mutex_lock(&fd_lock);
+    if (stream->pos == end) stream->pos = from;
+    pthread_mutex_unlock(&fd_lock);
+}
+
+// copy up to 'count' of the next entries of a directory stream and
+// move its cursor past them; return the number of entries copied (0 at
+// the end of the directory), with the position of the first one in
+// 'first' (unless NULL), or -1 on error; the caller holds the lock of
+// the directory, shared, and its extent map is built; threads using the
+// same stream at once get different entries
+static int dir_next(open_file_t *stream, dirent_t *dirents, int count, int *first) {
+    minode_t *ip = stream->ip;
+    pthread_mutex_lock(&fd_lock);
+    int pos = stream->inode < 0 ? ip->d.size : stream->pos;
+    if (count > ip->d.size - pos) count = ip->d.size - pos;
+    if (count < 0) count = 0;
+    stream->pos = pos + count;
+    pthread_mutex_unlock(&fd_lock);
+    if (first) *first = pos;
+
+    // the entries are copied straight out of the cached dirent sectors
+    // (or the inode)
+    for (int i = 0; i < count;) {
+        int n = DIRENTS_PER_SECTOR - (pos + i) % DIRENTS_PER_SECTOR;
+        if (n > count - i) n = count - i;
+        if (dirent_copy(ip, pos + i, dirents + i, n) < 0) {
+            dir_unread(stream, pos, pos + count);
+            return -1;
+        }
+        i += n;
+    }
+    return count;
+}
+
+// lock a directory shared, building its extent map first if need be;
+// return 0 if successful, -1 (with osErrno set) otherwise
+static int dir_rdlock(minode_t *ip) {
+    pthread_rwlock_rdlock(&ip->lock);
+    while (!ip->map) {
+        pthread_rwlock_unlock(&ip->lock);
+        pthread_rwlock_wrlock(&ip->lock);
+        int err = inode_map(ip);
+        pthread_rwlock_unlock(&ip->lock);
+        if (err < 0) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        pthread_rwlock_rdlock(&ip->lock);
+    }
+    return 0;
+}
+
+// read the next entries of a directory stream into 'buffer', as many
+// as fit in 'size' bytes, in the same format as Dir_Read(); return the
+// number of entries read (0 at the end of the directory), or -1 (with
+// osErrno set) on error; entries added or removed while the stream is
+// open may or may not be returned, every other one is returned once
+int Dir_Next(int dd, void *buffer, int size) {
+    dprintf("Dir_Next(%d, %d):\n", dd, size);
+    open_file_t *stream = get_open_dir(dd);
+    if (!stream) return -1;
+    int count = size / (int) sizeof(dirent_t);
+    if (count <= 0) {
+        osErrno = E_BUFFER_TOO_SMALL;
+        return -1;
+    }
+    if (dir_rdlock(stream->ip) < 0) return -1;
+    count = dir_next(stream, buffer, count, NULL);
+    pthread_rwlock_unlock(&stream->ip->lock);
+    if (count < 0) osErrno = E_GENERAL;
+    else dprintf("... read %d entries\n", count);
+    return count;
+}
+
+// read up to 'count' of the next entries of a directory stream, along
+// with the type and size of what they name; otherwise the same as
+// Dir_Next()
+int Dir_NextPlus(int dd, Dir_Entry_t *entries, int count) {
+    dprintf("Dir_NextPlus(%d, %d):\n", dd, count);
+    open_file_t *stream = get_open_dir(dd);
+    if (!stream) return -1;
+    if (count <= 0) {
+        osErrno = E_BUFFER_TOO_SMALL;
+        return -1;
+    }
+    if (dir_rdlock(stream->ip) < 0) return -1;
+
+    // a sector's worth of entries at a time; the entries can't go away
+    // while the directory is locked; if something fails, the entries
+    // filled in so far are returned, and the others are left for the
+    // next call
+    int total = 0, err = 0;
+    while (total < count && !err) {
+        dirent_t dirents[DIRENTS_PER_SECTOR];
+        int first, n = count - total < DIRENTS_PER_SECTOR ? count - total : DIRENTS_PER_SECTOR;
+        n = dir_next(stream, dirents, n, &first);
+        if (n < 0) err = -1;
+        if (n <= 0) break;
+        for (int i = 0; i < n; i++) {
+            Dir_Entry_t *entry = &entries[total];
+            memcpy(entry->name, dirents[i].fname, MAX_NAME);
+            entry->name[MAX_NAME - 1] = '\0';
+            entry->inode = dirents[i].inode;
+            minode_t *child = iget(dirents[i].inode);
+            if (!child) {
+                dir_unread(stream, first + i, first + n);
+                err = -1;
+                break;
+            }
+            pthread_rwlock_rdlock(&child->lock);
+            entry->type = child->d.type;
+            entry->size = child->d.type ? (int) (child->d.size * sizeof(dirent_t)) : child->d.size;
+            pthread_rwlock_unlock(&child->lock);
+            iput(child);
+            total++;
+        }
+    }
+    pthread_rwlock_unlock(&stream->ip->lock);
+    if (err && !total) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    dprintf("... read %d entries\n", total);
+    return total;
+}
+
+// close a directory stream; return 0 if successful, -1 (with osErrno
+// set) otherwise
+int Dir_Close(int dd) {
+    dprintf("Dir_Close(%d):\n", dd);
+    open_file_t *stream = get_open_dir(dd);
+    if (!stream) return -1;
+    minode_t *ip = stream->ip;
+    pthread_rwlock_wrlock(&ip->lock);
+    open_file_t **link = &ip->streams;
+    while (*link != stream)
+        link = &(*link)->snext;
+    *link = stream->snext;
+    pthread_mutex_lock(&fd_lock);
+    free_file_fd(dd);
+    pthread_mutex_unlock(&fd_lock);
+    pthread_rwlock_unlock(&ip->lock);
+    iput(ip);
+    dprintf("... directory closed successfully\n");
+    return 0;
+}
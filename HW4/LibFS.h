@@ -1,10 +1,13 @@
-/***************************/
-/* DO NOT MODIFY THIS FILE */
-/***************************/
+/***********************************************/
+/* shared by the file system and its programs: */
+/* keep the calls below backward compatible    */
+/***********************************************/
     
 #ifndef __LibFS_h__
 #define __LibFS_h__
 
+#include "LibDisk.h" // for the disk geometry the limits below depend on
+
 // error types
 typedef enum {
     E_GENERAL,      // general
@@ -22,8 +25,8 @@ typedef enum {
     E_BUFFER_TOO_SMALL, 
 } FS_Error_t;
     
-// used for errors
-extern int osErrno;
+// used for errors (per thread)
+extern __thread int osErrno;
 
 // a few file system parameters
 
@@ -31,16 +34,18 @@ extern int osErrno;
 // maximum limit of 1000
 #define MAX_FILES 1000
 
-// each file can have a maximum of 30 sectors; we treat the data
+// a file can have as many sectors as the disk; we treat the data
 // blocks of the file/director the same as sectors
-#define MAX_SECTORS_PER_FILE 30
+#define MAX_SECTORS_PER_FILE TOTAL_SECTORS
 
 // the size of a file or directory is limited
 #define MAX_FILE_SIZE (MAX_SECTORS_PER_FILE*SECTOR_SIZE)
 
-// file system generic calls
+// file system generic calls; all of the calls may be made from several
+// threads at once, except FS_Boot(), which must run alone
 int FS_Boot(char *path);
 int FS_Sync();
+int FS_CacheStats(int *hits, int *misses);
 
 // file ops
 int File_Create(char *file);
@@ -48,13 +53,42 @@ int File_Open(char *file);
 int File_Read(int fd, void *buffer, int size);
 int File_Write(int fd, void *buffer, int size);
 int File_Seek(int fd, int offset);
+int File_ReadAt(int fd, void *buffer, int size, int offset);
+int File_WriteAt(int fd, void *buffer, int size, int offset);
 int File_Close(int fd);
 int File_Unlink(char *file);
 
+// batches of files created or removed in one directory at once; the
+// names are those of the entries in 'path'; the number of files
+// created/removed is returned, fewer than 'count' (with osErrno set as
+// for one file) if one couldn't be, in which case those before it were
+// and those after it weren't; -1 (with osErrno set) if 'path' is not a
+// directory
+int File_CreateBatch(char *path, char **names, int count);
+int File_UnlinkBatch(char *path, char **names, int count);
+
 // directory ops
 int Dir_Create(char *path);
 int Dir_Unlink(char *path);
 int Dir_Size(char *path);
 int Dir_Read(char *path, void *buffer, int size);
+int Dir_CreateBatch(char *path, char **names, int count); // see File_CreateBatch()
+int Dir_UnlinkBatch(char *path, char **names, int count);
+
+// an entry of a directory, with the type and size of the file or
+// directory it names, as returned by Dir_NextPlus()
+typedef struct {
+    char name[16]; // the name (null-terminated)
+    int inode;     // its inode
+    int type;      // 0 for a file, 1 for a directory
+    int size;      // the size of the file, or of the directory as Dir_Size() reports it
+} Dir_Entry_t;
+
+// directory streams; entries are read a few at a time instead of all
+// at once, and the descriptors come from the same table as files
+int Dir_Open(char *path);
+int Dir_Next(int dd, void *buffer, int size);
+int Dir_NextPlus(int dd, Dir_Entry_t *entries, int count);
+int Dir_Close(int dd);
 
 #endif /* __LibFS_h__ */
@@ -0,0 +1,286 @@
+// microbenchmarks of the file system: metadata operations against the
+// size and depth of directories, sequential and random file i/o, the
+// cost of FS_Sync() against the amount of dirty data, and the time
+// FS_Boot() takes against how full the disk is
+//
+// the results go to the standard output as CSV, one line per case:
+// the wall time of an operation, the sectors it read and wrote on the
+// disk, and the time the simulated device spent on them, all averaged
+// over the operations of the case; 'bytes' is what an operation
+// transferred (0 for metadata operations)
+//
+// usage: bench.exe [image] (bench.img by default; it's reformatted)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// max length of a path (as in the file system)
+#define PATH_LEN 256
+
+static char *image = "bench.img";
+
+// where a measurement started
+typedef struct {
+    double wall;
+    Disk_Stats_t disk;
+} mark_t;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void start(mark_t *m) {
+    Disk_GetStats(&m->disk);
+    m->wall = now_us();
+}
+
+// print a line of results for 'ops' operations that took 'wall'
+// microseconds and did the i/o in 'd'
+static void print(char *group, char *name, long param, int ops, long bytes,
+                  double wall, Disk_Stats_t *d) {
+    if (ops <= 0) ops = 1;
+    printf("%s,%s,%ld,%d,%ld,%.3f,%.3f,%.3f,%.3f\n", group, name, param, ops, bytes,
+           wall / ops, (double) d->reads / ops, (double) d->writes / ops, d->time / ops);
+    fflush(stdout);
+}
+
+// print a line of results for 'ops' operations since 'm'
+static void report(mark_t *m, char *group, char *name, long param, int ops, long bytes) {
+    double wall = now_us() - m->wall;
+    Disk_Stats_t d;
+    Disk_GetStats(&d);
+    d.reads -= m->disk.reads;
+    d.writes -= m->disk.writes;
+    d.time -= m->disk.time;
+    print(group, name, param, ops, bytes, wall, &d);
+}
+
+static void fail(char *what) {
+    fprintf(stderr, "bench: %s failed (osErrno %d)\n", what, osErrno);
+    exit(1);
+}
+
+// start over with an empty file system
+static void format() {
+    char name[1100];
+    unlink(image);
+    snprintf(name, sizeof name, "%s.journal", image);
+    unlink(name);
+    snprintf(name, sizeof name, "%s.journal.old", image);
+    unlink(name);
+    if (FS_Boot(image) < 0) fail("FS_Boot");
+}
+
+// create, open/close and unlink 'n' files in directory 'dir', and then
+// create them again as one batch
+static void bench_names(char *dir, char *group, long param, int n) {
+    char path[PATH_LEN], (*names)[16] = malloc(n * sizeof *names);
+    char **list = malloc(n * sizeof(char *));
+    mark_t m;
+    for (int i = 0; i < n; i++) {
+        sprintf(names[i], "f%d", i);
+        list[i] = names[i];
+    }
+
+    start(&m);
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof path, "%s/%s", dir, names[i]);
+        if (File_Create(path) < 0) fail("File_Create");
+    }
+    report(&m, group, "create", param, n, 0);
+
+    start(&m);
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof path, "%s/%s", dir, names[i]);
+        int fd = File_Open(path);
+        if (fd < 0 || File_Close(fd) < 0) fail("File_Open");
+    }
+    report(&m, group, "open", param, n, 0);
+
+    start(&m);
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof path, "%s/%s", dir, names[i]);
+        if (File_Unlink(path) < 0) fail("File_Unlink");
+    }
+    report(&m, group, "unlink", param, n, 0);
+
+    start(&m);
+    if (File_CreateBatch(dir, list, n) != n) fail("File_CreateBatch");
+    report(&m, group, "create_batch", param, n, 0);
+
+    start(&m);
+    if (File_UnlinkBatch(dir, list, n) != n) fail("File_UnlinkBatch");
+    report(&m, group, "unlink_batch", param, n, 0);
+    free(list);
+    free(names);
+}
+
+// metadata operations against the number of entries of a directory
+static void bench_dir_size() {
+    static int sizes[] = {10, 100, 900};
+    for (int i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+        format();
+        if (Dir_Create("/d") < 0) fail("Dir_Create");
+        bench_names("/d", "dir_size", sizes[i], sizes[i]);
+    }
+}
+
+// metadata operations against the depth of the directory
+static void bench_dir_depth() {
+    static int depths[] = {1, 8, 32};
+    for (int i = 0; i < sizeof depths / sizeof depths[0]; i++) {
+        format();
+        char path[PATH_LEN] = "";
+        for (int d = 0; d < depths[i]; d++) {
+            strcat(path, "/d");
+            if (Dir_Create(path) < 0) fail("Dir_Create");
+        }
+        bench_names(path, "dir_depth", depths[i], 100);
+    }
+}
+
+// sequential writes and reads (cold, after a reboot, and then warm)
+// of a file in chunks of a few sizes
+#define FILE_BYTES (2 * 1024 * 1024)
+
+static void bench_sequential() {
+    static int chunks[] = {512, 4096, 65536};
+    char *buf = malloc(65536);
+    memset(buf, 'x', 65536);
+    for (int i = 0; i < sizeof chunks / sizeof chunks[0]; i++) {
+        int chunk = chunks[i], n = FILE_BYTES / chunk;
+        mark_t m;
+        format();
+        if (File_Create("/seq") < 0) fail("File_Create");
+        int fd = File_Open("/seq");
+        start(&m);
+        for (int k = 0; k < n; k++) {
+            if (File_Write(fd, buf, chunk) != chunk) fail("File_Write");
+        }
+        if (File_Close(fd) < 0 || FS_Sync() < 0) fail("FS_Sync");
+        report(&m, "sequential", "write", chunk, n, chunk);
+
+        if (FS_Boot(image) < 0) fail("FS_Boot");
+        for (int pass = 0; pass < 2; pass++) {
+            if ((fd = File_Open("/seq")) < 0) fail("File_Open");
+            start(&m);
+            for (int k = 0; k < n; k++) {
+                if (File_Read(fd, buf, chunk) != chunk) fail("File_Read");
+            }
+            report(&m, "sequential", pass ? "read_warm" : "read_cold", chunk, n, chunk);
+            File_Close(fd);
+        }
+    }
+    free(buf);
+}
+
+// reads and writes at random places of a file
+static void bench_random() {
+    static int chunks[] = {512, 4096};
+    char *buf = malloc(4096);
+    memset(buf, 'y', 4096);
+    format();
+    if (File_Create("/rnd") < 0) fail("File_Create");
+    int fd = File_Open("/rnd");
+    for (int k = 0; k < FILE_BYTES / 4096; k++) {
+        if (File_Write(fd, buf, 4096) != 4096) fail("File_Write");
+    }
+    if (File_Close(fd) < 0 || FS_Sync() < 0) fail("FS_Sync");
+    for (int i = 0; i < sizeof chunks / sizeof chunks[0]; i++) {
+        int chunk = chunks[i], n = 2000;
+        mark_t m;
+        srand(1);
+        if (FS_Boot(image) < 0 || (fd = File_Open("/rnd")) < 0) fail("File_Open");
+        start(&m);
+        for (int k = 0; k < n; k++) {
+            int pos = rand() % (FILE_BYTES / chunk) * chunk;
+            if (File_ReadAt(fd, buf, chunk, pos) != chunk) fail("File_ReadAt");
+        }
+        report(&m, "random", "read", chunk, n, chunk);
+        start(&m);
+        for (int k = 0; k < n; k++) {
+            int pos = rand() % (FILE_BYTES / chunk) * chunk;
+            if (File_WriteAt(fd, buf, chunk, pos) != chunk) fail("File_WriteAt");
+        }
+        if (FS_Sync() < 0) fail("FS_Sync");
+        report(&m, "random", "write", chunk, n, chunk);
+        File_Close(fd);
+    }
+    free(buf);
+}
+
+// FS_Sync() against the number of sectors written since the last one
+static void bench_sync() {
+    static int dirty[] = {0, 16, 256, 2048};
+    char buf[SECTOR_SIZE];
+    memset(buf, 'z', SECTOR_SIZE);
+    format();
+    if (File_Create("/s") < 0) fail("File_Create");
+    int fd = File_Open("/s");
+    for (int k = 0; k < 2048; k++) {
+        if (File_Write(fd, buf, SECTOR_SIZE) != SECTOR_SIZE) fail("File_Write");
+    }
+    if (FS_Sync() < 0) fail("FS_Sync");
+    for (int i = 0; i < sizeof dirty / sizeof dirty[0]; i++) {
+        mark_t m;
+        for (int k = 0; k < dirty[i]; k++) {
+            if (File_WriteAt(fd, buf, SECTOR_SIZE, k * SECTOR_SIZE) != SECTOR_SIZE) fail("File_WriteAt");
+        }
+        start(&m);
+        if (FS_Sync() < 0) fail("FS_Sync");
+        report(&m, "sync", "sync", dirty[i], 1, (long) dirty[i] * SECTOR_SIZE);
+    }
+    File_Close(fd);
+}
+
+// FS_Boot() against the amount of data on the disk
+static void bench_boot() {
+    static int megabytes[] = {0, 1, 2, 4};
+    char *buf = malloc(65536);
+    memset(buf, 'w', 65536);
+    for (int i = 0; i < sizeof megabytes / sizeof megabytes[0]; i++) {
+        format();
+        if (File_Create("/fill") < 0) fail("File_Create");
+        int fd = File_Open("/fill");
+        for (int k = 0; k < megabytes[i] * 16; k++) {
+            if (File_Write(fd, buf, 65536) != 65536) fail("File_Write");
+        }
+        if (File_Close(fd) < 0 || FS_Sync() < 0) fail("FS_Sync");
+
+        // booting resets the disk statistics, so what each boot did is
+        // what they show right after it
+        Disk_Stats_t sum = {0}, d;
+        double wall = 0;
+        int n = 20;
+        for (int k = 0; k < n; k++) {
+            double t = now_us();
+            if (FS_Boot(image) < 0) fail("FS_Boot");
+            wall += now_us() - t;
+            Disk_GetStats(&d);
+            sum.reads += d.reads;
+            sum.writes += d.writes;
+            sum.time += d.time;
+        }
+        print("boot", "boot", megabytes[i], n, 0, wall, &sum);
+    }
+    free(buf);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) image = argv[1];
+    printf("group,case,param,ops,bytes,wall_us,reads,writes,disk_us\n");
+    bench_dir_size();
+    bench_dir_depth();
+    bench_sequential();
+    bench_random();
+    bench_sync();
+    bench_boot();
+    return 0;
+}
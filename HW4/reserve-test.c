@@ -0,0 +1,102 @@
+// checks that data acknowledged by File_Write() while it's only held in
+// a write buffer reaches the disk even if the disk fills up before the
+// buffer is flushed: small writes to one file are buffered, then large
+// writes to another file (which go straight to the disk) and new
+// directory entries take up all the space that isn't reserved for the
+// buffer; closing the first file must succeed, and all of its data
+// must read back; once the second file is removed, as much space must
+// be usable again
+//
+// usage: reserve-test.exe [image] (reserve-test.img by default; it's
+// reformatted and removed afterwards); prints "ok" and exits with 0 if
+// the checks pass
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+#define SMALL 100
+#define SMALL_WRITES 200
+#define BIG 65536
+
+static char *image = "reserve-test.img";
+
+static void remove_image() {
+    char name[1100];
+    unlink(image);
+    snprintf(name, sizeof name, "%s.journal", image);
+    unlink(name);
+    snprintf(name, sizeof name, "%s.journal.old", image);
+    unlink(name);
+    snprintf(name, sizeof name, "%s.tmp", image);
+    unlink(name);
+}
+
+static void fail(char *what) {
+    fprintf(stderr, "reserve-test: %s (osErrno %d)\n", what, osErrno);
+    remove_image();
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) image = argv[1];
+    remove_image();
+    if (FS_Boot(image) < 0) fail("FS_Boot failed");
+
+    // small writes, held in the write buffer of /a
+    char small[SMALL];
+    memset(small, 'a', SMALL);
+    if (File_Create("/a") < 0) fail("File_Create failed");
+    int a = File_Open("/a");
+    for (int i = 0; i < SMALL_WRITES; i++) {
+        if (File_Write(a, small, SMALL) != SMALL) fail("small write failed");
+    }
+
+    // large writes fill the disk; they must stop short of the space
+    // reserved for /a, and say why
+    char *big = malloc(BIG);
+    memset(big, 'b', BIG);
+    if (File_Create("/b") < 0) fail("File_Create failed");
+    int b = File_Open("/b"), n;
+    long filled = 0;
+    while ((n = File_Write(b, big, BIG)) > 0)
+        filled += n;
+    if (osErrno != E_NO_SPACE) fail("the disk filled up with the wrong error");
+
+    // so must the allocations for directories and their entries
+    char path[32];
+    for (int i = 0; i < 300; i++) {
+        sprintf(path, "/d%d", i);
+        Dir_Create(path);
+        sprintf(path, "/d0/e%d", i);
+        File_Create(path);
+    }
+
+    // the buffered data is written out now
+    if (File_Close(a) < 0) fail("closing the file with buffered data failed");
+    if (File_Close(b) < 0) fail("File_Close failed");
+    char back[SMALL * SMALL_WRITES];
+    a = File_Open("/a");
+    if (File_Read(a, back, sizeof back) != sizeof back) fail("buffered data lost");
+    for (int i = 0; i < (int) sizeof back; i++) {
+        if (back[i] != 'a') fail("buffered data damaged");
+    }
+    File_Close(a);
+
+    // nothing stays reserved
+    if (File_Unlink("/b") < 0 || File_Create("/c") < 0) fail("File_Unlink failed");
+    int c = File_Open("/c");
+    long refilled = 0;
+    while (File_Write(c, small, SMALL) == SMALL)
+        refilled += SMALL;
+    File_Close(c);
+    if (refilled < filled) fail("space still reserved after the flush");
+
+    free(big);
+    remove_image();
+    printf("ok\n");
+    return 0;
+}